@@ -0,0 +1,153 @@
+// CRC-32 (as used by zip and PNG) and SHA-1 (FIPS 180-1). All arithmetic is
+// masked to 32 bits, so this also works where long has 64 bits.
+#include <dos.h>
+#include <string.h>
+#include "digest.h"
+
+#define MASK32 0xFFFFFFFFUL
+#define ROL(x, n) ((((x) << (n)) | ((x) >> (32 - (n)))) & MASK32)
+
+static unsigned long crc_table[256];
+static int crc_table_ready = 0;
+
+void crc32_init(crc32_ctx *ctx)
+{
+    unsigned i, bit;
+    if (!crc_table_ready)
+    {
+        for (i = 0; i < 256; i++)
+        {
+            unsigned long c = i;
+            for (bit = 0; bit < 8; bit++)
+                c = (c & 1) ? (c >> 1) ^ 0xEDB88320UL : c >> 1;
+            crc_table[i] = c;
+        }
+        crc_table_ready = 1;
+    }
+    ctx->crc = MASK32;
+}
+
+void crc32_update(crc32_ctx *ctx, const unsigned char far* data, unsigned size)
+{
+    unsigned long crc = ctx->crc;
+    while (size--)
+        crc = crc_table[(unsigned char)crc ^ *data++] ^ (crc >> 8);
+    ctx->crc = crc;
+}
+
+unsigned long crc32_final(crc32_ctx *ctx)
+{
+    return ctx->crc ^ MASK32;
+}
+
+void sha1_init(sha1_ctx *ctx)
+{
+    ctx->h[0] = 0x67452301UL;
+    ctx->h[1] = 0xEFCDAB89UL;
+    ctx->h[2] = 0x98BADCFEUL;
+    ctx->h[3] = 0x10325476UL;
+    ctx->h[4] = 0xC3D2E1F0UL;
+    ctx->length = 0;
+    ctx->fill = 0;
+}
+
+// The message schedule is kept as a ring of 16 words to save stack
+static void sha1_block(sha1_ctx *ctx)
+{
+    unsigned long w[16];
+    unsigned long a, b, c, d, e, f, k, t;
+    unsigned i;
+    for (i = 0; i < 16; i++)
+    {
+        const unsigned char *p = ctx->block + 4 * i;
+        w[i] = ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) |
+               ((unsigned)p[2] << 8) | p[3];
+    }
+    a = ctx->h[0];
+    b = ctx->h[1];
+    c = ctx->h[2];
+    d = ctx->h[3];
+    e = ctx->h[4];
+    for (i = 0; i < 80; i++)
+    {
+        if (i >= 16)
+        {
+            t = w[(i + 13) & 15] ^ w[(i + 8) & 15] ^ w[(i + 2) & 15] ^ w[i & 15];
+            w[i & 15] = ROL(t, 1);
+        }
+        if (i < 20)
+        {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999UL;
+        }
+        else if (i < 40)
+        {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1UL;
+        }
+        else if (i < 60)
+        {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDCUL;
+        }
+        else
+        {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6UL;
+        }
+        t = (ROL(a, 5) + (f & MASK32) + e + k + w[i & 15]) & MASK32;
+        e = d;
+        d = c;
+        c = ROL(b, 30);
+        b = a;
+        a = t;
+    }
+    ctx->h[0] = (ctx->h[0] + a) & MASK32;
+    ctx->h[1] = (ctx->h[1] + b) & MASK32;
+    ctx->h[2] = (ctx->h[2] + c) & MASK32;
+    ctx->h[3] = (ctx->h[3] + d) & MASK32;
+    ctx->h[4] = (ctx->h[4] + e) & MASK32;
+}
+
+void sha1_update(sha1_ctx *ctx, const unsigned char far* data, unsigned size)
+{
+    ctx->length = (ctx->length + size) & MASK32;
+    while (size > 0)
+    {
+        unsigned n = 64 - ctx->fill;
+        if (n > size)
+            n = size;
+        _fmemcpy(ctx->block + ctx->fill, data, n);
+        ctx->fill += n;
+        data += n;
+        size -= n;
+        if (ctx->fill == 64)
+        {
+            sha1_block(ctx);
+            ctx->fill = 0;
+        }
+    }
+}
+
+void sha1_final(sha1_ctx *ctx, unsigned char digest[20])
+{
+    unsigned long bits_high = ctx->length >> 29;
+    unsigned long bits_low = (ctx->length << 3) & MASK32;
+    unsigned i;
+    ctx->block[ctx->fill++] = 0x80;
+    if (ctx->fill > 56)
+    {
+        memset(ctx->block + ctx->fill, 0, 64 - ctx->fill);
+        sha1_block(ctx);
+        ctx->fill = 0;
+    }
+    memset(ctx->block + ctx->fill, 0, 56 - ctx->fill);
+    for (i = 0; i < 4; i++)
+    {
+        ctx->block[56 + i] = (unsigned char)(bits_high >> (24 - 8 * i));
+        ctx->block[60 + i] = (unsigned char)(bits_low >> (24 - 8 * i));
+    }
+    sha1_block(ctx);
+    for (i = 0; i < 20; i++)
+        digest[i] = (unsigned char)(ctx->h[i / 4] >> (24 - 8 * (i & 3)));
+}
@@ -0,0 +1,19 @@
+// Incremental checksums over far data
+typedef struct {
+    unsigned long crc;
+} crc32_ctx;
+
+typedef struct {
+    unsigned long h[5];
+    unsigned long length;       // in bytes
+    unsigned char block[64];
+    unsigned fill;
+} sha1_ctx;
+
+void crc32_init(crc32_ctx *ctx);
+void crc32_update(crc32_ctx *ctx, const unsigned char far* data, unsigned size);
+unsigned long crc32_final(crc32_ctx *ctx);
+
+void sha1_init(sha1_ctx *ctx);
+void sha1_update(sha1_ctx *ctx, const unsigned char far* data, unsigned size);
+void sha1_final(sha1_ctx *ctx, unsigned char digest[20]);
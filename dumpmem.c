@@ -1,102 +1,1361 @@
 #include <dos.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <stdio.h>
+#include "digest.h"
+#include "extmem.h"
+#include "pci.h"
 
-void extread(void far* dest, unsigned long src, size_t size)
+// The largest multiple of the sector size a single DOS write accepts. Whole
+// sectors from an aligned buffer let DOS transfer directly from the buffer.
+#define SECTOR_SIZE 0x200
+#define TRANSFER_SIZE 0xFE00u
+
+// Allocates TRANSFER_SIZE bytes from DOS, aligned to a sector boundary.
+// The block is released when the program exits.
+void far* alloc_transfer_buffer(void)
+{
+    unsigned seg;
+    const unsigned align = SECTOR_SIZE / 16;
+    if (_dos_allocmem(TRANSFER_SIZE / 16 + align - 1, &seg) != 0)
+        return NULL;
+    return MK_FP((seg + align - 1) & ~(align - 1), 0);
+}
+
+// Hands a block straight to DOS (INT 21h, AH=40h), bypassing stdio
+int write_block(int handle, const void far* buffer, unsigned size)
+{
+    unsigned written;
+    if (_dos_write(handle, buffer, size, &written) != 0 || written != size)
+        return -1;
+    return 0;
+}
+
+// Moves the file pointer (INT 21h, AH=42h), returns the new position or -1
+long dos_seek(int handle, unsigned long offset, int whence)
 {
-    unsigned short gdt[8*4];    // 8 descriptors, 4 words each
     union REGS r;
-    struct SREGS sr;
-    unsigned long dest_lin;
-    dest_lin = (((unsigned long)FP_SEG(dest)) << 4) + (FP_OFF(dest));
-    gdt[8] = 0xFFFF;            // src limit
-    gdt[9] = src & 0xFFFF;
-    gdt[10] = ((src >> 16) & 0xFF) | 0x9300;
-    gdt[11] = (src >> 16) & 0xFF00;
-
-    gdt[12] = 0xFFFF;           // dst limit
-    gdt[13] = dest_lin & 0xFFFF;
-    gdt[14] = (dest_lin >> 16) | 0x9300;
-    gdt[15] = 0;
-
-    r.h.ah = 0x87;
-    r.x.cx = size / 2;
-    r.x.si = FP_OFF((void far*)gdt);
-    segread(&sr);
-    sr.es = sr.ss;
-    int86x(0x15, &r, &r, &sr);
+    r.h.ah = 0x42;
+    r.h.al = (unsigned char)whence;
+    r.x.bx = handle;
+    r.x.cx = (unsigned)(offset >> 16);
+    r.x.dx = (unsigned)offset;
+    intdos(&r, &r);
+    if (r.x.cflag)
+        return -1;
+    return ((long)r.x.dx << 16) | r.x.ax;
 }
 
-int main(int argc, char** argv)
+// The BIOS timer tick count at 0040:006C, continued across midnight
+unsigned long bios_ticks(void)
+{
+    static unsigned long last, wraps;
+    unsigned long now;
+    _disable();
+    now = *(unsigned long far*)MK_FP(0x40, 0x6C);
+    _enable();
+    if (now < last)
+        wraps += 0x1800B0UL;
+    last = now;
+    return now + wraps;
+}
+
+// KB per second from a byte count and a duration in 18.2Hz timer ticks
+unsigned long kb_per_second(unsigned long bytes, unsigned long ticks)
+{
+    return ticks ? bytes / 1024 * 182 / (ticks * 10) : 0;
+}
+
+void far* transfer_buffer;
+unsigned long staging_address;  // XMS block
+unsigned long staging_size;     // 0 without XMS
+
+// The output file is committed every COMMIT_INTERVAL chunks, so its length
+// in the directory tells -resume where to continue after a hang.
+#define COMMIT_INTERVAL 16
+
+int outfile = -1;
+unsigned chunks_written = 0;
+int verify_file = -1;
+void far* verify_buffer;
+int mismatch = 0;
+int hashing = 0;
+crc32_ctx crc;
+sha1_ctx sha1;
+
+void put_dword(unsigned char far* p, unsigned long value)
+{
+    p[0] = (unsigned char)value;
+    p[1] = (unsigned char)(value >> 8);
+    p[2] = (unsigned char)(value >> 16);
+    p[3] = (unsigned char)(value >> 24);
+}
+
+// Run length encoded output (-rle), all numbers little endian:
+//   header:  "MEMRLE", version (1 byte), reserved (1 byte)
+//   records: 00..7F  followed by 1..128 literal bytes
+//            80..FE  followed by a byte repeated 4..130 times
+//            FF      followed by a 32-bit repeat count and the byte
+#define RLE_MAGIC "MEMRLE"
+#define RLE_VERSION 1
+#define RLE_HEADER_SIZE 8
+#define RLE_MIN_RUN 4
+#define RLE_MAX_SHORT_RUN (0xFE - 0x80 + RLE_MIN_RUN)
+
+int rle = 0;
+unsigned char far* rle_buffer;  // encoded data waiting to be written
+unsigned rle_fill;
+unsigned char rle_literal[128];
+unsigned rle_literal_count;
+unsigned char rle_byte;
+unsigned long rle_run;          // repetitions of rle_byte seen so far
+
+int rle_put(const unsigned char far* data, unsigned size)
+{
+    if (rle_fill + size > TRANSFER_SIZE)
+    {
+        if (write_block(outfile, rle_buffer, rle_fill) < 0)
+            return -1;
+        rle_fill = 0;
+    }
+    _fmemcpy(rle_buffer + rle_fill, data, size);
+    rle_fill += size;
+    return 0;
+}
+
+int rle_flush_literal(void)
+{
+    unsigned char control;
+    if (rle_literal_count == 0)
+        return 0;
+    control = (unsigned char)(rle_literal_count - 1);
+    if (rle_put(&control, 1) < 0 || rle_put(rle_literal, rle_literal_count) < 0)
+        return -1;
+    rle_literal_count = 0;
+    return 0;
+}
+
+// Short runs are not worth a record and become part of a literal
+int rle_flush_run(void)
+{
+    unsigned char record[6];
+    if (rle_run >= RLE_MIN_RUN)
+    {
+        if (rle_flush_literal() < 0)
+            return -1;
+        if (rle_run <= RLE_MAX_SHORT_RUN)
+        {
+            record[0] = (unsigned char)(0x80 + rle_run - RLE_MIN_RUN);
+            record[1] = rle_byte;
+            if (rle_put(record, 2) < 0)
+                return -1;
+        }
+        else
+        {
+            record[0] = 0xFF;
+            put_dword(record + 1, rle_run);
+            record[5] = rle_byte;
+            if (rle_put(record, 6) < 0)
+                return -1;
+        }
+        rle_run = 0;
+    }
+    for (; rle_run > 0; rle_run--)
+    {
+        rle_literal[rle_literal_count++] = rle_byte;
+        if (rle_literal_count == sizeof rle_literal && rle_flush_literal() < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int rle_write(const unsigned char far* data, unsigned size)
+{
+    unsigned i;
+    for (i = 0; i < size; i++)
+    {
+        if (rle_run > 0 && data[i] == rle_byte)
+        {
+            rle_run++;
+            continue;
+        }
+        if (rle_flush_run() < 0)
+            return -1;
+        rle_byte = data[i];
+        rle_run = 1;
+    }
+    return 0;
+}
+
+int rle_start(void)
+{
+    unsigned char header[RLE_HEADER_SIZE];
+    memcpy(header, RLE_MAGIC, 6);
+    header[6] = RLE_VERSION;
+    header[7] = 0;
+    rle_fill = 0;
+    rle_literal_count = 0;
+    rle_run = 0;
+    return rle_put(header, RLE_HEADER_SIZE);
+}
+
+int rle_finish(void)
+{
+    if (rle_flush_run() < 0 || rle_flush_literal() < 0)
+        return -1;
+    return write_block(outfile, rle_buffer, rle_fill);
+}
+
+// Writes to the output file, run length encoded with -rle
+int output(const void far* data, unsigned size)
+{
+    if (rle)
+        return rle_write(data, size);
+    return write_block(outfile, data, size);
+}
+
+// Restores the raw file from an -rle file
+int expand_file(const char *packed, const char *filename)
 {
-    const size_t bufsize = 0x8000;
-    void* buffer;
-    FILE *outfile;
-    unsigned long base;
+    unsigned char far* out = transfer_buffer;
+    unsigned char header[RLE_HEADER_SIZE];
+    unsigned long count;
+    unsigned fill = 0;
+    unsigned n;
+    int c, value;
+    int literal;
+    int status = 0;
+    FILE *in = fopen(packed, "rb");
+    if (!in)
+    {
+        perror(packed);
+        return -1;
+    }
+    if (fread(header, 1, RLE_HEADER_SIZE, in) != RLE_HEADER_SIZE ||
+        memcmp(header, RLE_MAGIC, 6) != 0 || header[6] != RLE_VERSION)
+    {
+        fprintf(stderr, "%s is not a run length encoded dump\n", packed);
+        fclose(in);
+        return -1;
+    }
+    if (_dos_creat(filename, _A_NORMAL, &outfile) != 0)
+    {
+        perror(filename);
+        fclose(in);
+        return -1;
+    }
+    while (status == 0 && (c = getc(in)) != EOF)
+    {
+        literal = c < 0x80;
+        if (literal)
+        {
+            count = c + 1;
+            value = 0;
+        }
+        else if (c < 0xFF)
+        {
+            count = c - 0x80 + RLE_MIN_RUN;
+            value = getc(in);
+        }
+        else
+        {
+            count = 0;
+            for (n = 0; n < 4; n++)
+                count |= (unsigned long)(getc(in) & 0xFF) << (8 * n);
+            value = getc(in);
+        }
+        while (count > 0 && status == 0)
+        {
+            n = TRANSFER_SIZE - fill;
+            if (n > count)
+                n = (unsigned)count;
+            if (literal)
+            {
+                value = getc(in);
+                out[fill] = (unsigned char)value;
+                n = 1;
+            }
+            else if (value != EOF)
+                _fmemset(out + fill, value, n);
+            if (value == EOF)
+            {
+                fprintf(stderr, "%s is truncated\n", packed);
+                status = -2;
+                break;
+            }
+            fill += n;
+            count -= n;
+            if (fill == TRANSFER_SIZE)
+            {
+                status = write_block(outfile, out, fill);
+                fill = 0;
+            }
+        }
+    }
+    fclose(in);
+    if (status == 0)
+        status = write_block(outfile, out, fill);
+    if (_dos_close(outfile) != 0 && status == 0)
+        status = -1;
+    if (status == -1)
+        fputs("write error\n", stderr);
+    return status;
+}
+
+// Compares a chunk with the next bytes of the verify file and reports the
+// first difference.
+int verify_chunk(unsigned long address, const unsigned char far* data, unsigned size)
+{
+    const unsigned char far* expected = verify_buffer;
+    unsigned got, i;
+    if (_dos_read(verify_file, verify_buffer, size, &got) != 0)
+    {
+        fputs("read error\n", stderr);
+        return -1;
+    }
+    for (i = 0; i < got; i++)
+    {
+        if (data[i] != expected[i])
+        {
+            printf("mismatch at %08lx: memory %02x, file %02x\n",
+                   address + i, data[i], expected[i]);
+            mismatch = 1;
+            return -1;
+        }
+    }
+    if (got < size)
+    {
+        printf("file ends at %08lx\n", address + got);
+        mismatch = 1;
+        return -1;
+    }
+    return 0;
+}
+
+// Signature search: an Aho-Corasick automaton finds all patterns in one
+// pass. Its state carries over from one chunk to the next, so matches that
+// span chunk boundaries are found as well.
+#define MAX_PATTERNS 16
+#define MAX_PATTERN_LENGTH 16
+#define MAX_STATES 64
+
+struct pattern {
+    char name[2 * MAX_PATTERN_LENGTH + 1];
+    unsigned char bytes[MAX_PATTERN_LENGTH];
+    unsigned length;
+};
+
+struct pattern patterns[MAX_PATTERNS];
+int pattern_count = 0;
+int finding = 0;
+unsigned window_size = 0;
+unsigned long hit_count;
+
+unsigned char next_state[MAX_STATES][256];
+unsigned matches[MAX_STATES];   // bit mask of the patterns ending in a state
+int state_count;
+unsigned char search_state;
+
+// Parses a comma separated list of patterns, \xx stands for the byte with
+// hex value xx.
+int parse_patterns(const char *list)
+{
+    const char *p = list;
+    while (*p)
+    {
+        struct pattern *pat = &patterns[pattern_count];
+        unsigned namelen = strcspn(p, ",");
+        unsigned value;
+        char dummy;
+        if (pattern_count == MAX_PATTERNS || namelen >= sizeof pat->name)
+        {
+            fprintf(stderr, "too many or too long patterns in %s\n", list);
+            return -1;
+        }
+        memcpy(pat->name, p, namelen);
+        pat->name[namelen] = '\0';
+        pat->length = 0;
+        while (*p && *p != ',')
+        {
+            if (pat->length == MAX_PATTERN_LENGTH)
+            {
+                fprintf(stderr, "pattern %s too long\n", pat->name);
+                return -1;
+            }
+            if (p[0] == '\\' && p[1] && p[2] && p[1] != ',' && p[2] != ',')
+            {
+                char hex[3];
+                hex[0] = p[1];
+                hex[1] = p[2];
+                hex[2] = '\0';
+                if (sscanf(hex, "%x%c", &value, &dummy) != 1)
+                {
+                    fprintf(stderr, "bad escape in pattern %s\n", pat->name);
+                    return -1;
+                }
+                pat->bytes[pat->length++] = (unsigned char)value;
+                p += 3;
+            }
+            else
+                pat->bytes[pat->length++] = (unsigned char)*p++;
+        }
+        if (pat->length == 0)
+        {
+            fprintf(stderr, "empty pattern in %s\n", list);
+            return -1;
+        }
+        pattern_count++;
+        if (*p == ',')
+            p++;
+    }
+    return pattern_count > 0 ? 0 : -1;
+}
+
+// Builds the trie of all patterns, then completes it to a full transition
+// table along the failure links in breadth first order.
+int build_automaton(void)
+{
+    unsigned char fail[MAX_STATES];
+    unsigned char queue[MAX_STATES];
+    int head = 0, tail = 0;
+    int i, c;
+    unsigned j;
+    memset(next_state, 0, sizeof next_state);
+    memset(matches, 0, sizeof matches);
+    state_count = 1;
+    for (i = 0; i < pattern_count; i++)
+    {
+        int s = 0;
+        for (j = 0; j < patterns[i].length; j++)
+        {
+            unsigned char b = patterns[i].bytes[j];
+            if (next_state[s][b] == 0)
+            {
+                if (state_count == MAX_STATES)
+                {
+                    fputs("patterns too long\n", stderr);
+                    return -1;
+                }
+                next_state[s][b] = (unsigned char)state_count++;
+            }
+            s = next_state[s][b];
+        }
+        matches[s] |= 1u << i;
+    }
+    for (c = 0; c < 256; c++)
+    {
+        unsigned char s = next_state[0][c];
+        if (s != 0)
+        {
+            fail[s] = 0;
+            queue[tail++] = s;
+        }
+    }
+    while (head < tail)
+    {
+        unsigned char s = queue[head++];
+        matches[s] |= matches[fail[s]];
+        for (c = 0; c < 256; c++)
+        {
+            unsigned char t = next_state[s][c];
+            if (t != 0)
+            {
+                fail[t] = next_state[fail[s]][c];
+                queue[tail++] = t;
+            }
+            else
+                next_state[s][c] = next_state[fail[s]][c];
+        }
+    }
+    return 0;
+}
+
+void print_window(unsigned long address, unsigned length)
+{
+    unsigned char window[16];
+    unsigned long start = address >= window_size ? address - window_size : 0;
+    unsigned long end = address + length - 1 + window_size;
+    unsigned i, n;
+    if (end < address)
+        end = 0xFFFFFFFFUL;
+    while (start <= end)
+    {
+        n = end - start >= 15 ? 16 : (unsigned)(end - start + 1);
+        extread(window, start, n);
+        printf("  %08lx:", start);
+        for (i = 0; i < n; i++)
+            printf(" %02x", window[i]);
+        printf("%*s  ", 3 * (16 - n), "");
+        for (i = 0; i < n; i++)
+            putchar(window[i] >= 0x20 && window[i] < 0x7F ? window[i] : '.');
+        putchar('\n');
+        start += n;
+        if (start == 0)
+            break;
+    }
+}
+
+void search_chunk(unsigned long address, const unsigned char far* data, unsigned size)
+{
+    unsigned char s = search_state;
+    unsigned i;
+    int p;
+    for (i = 0; i < size; i++)
+    {
+        s = next_state[s][data[i]];
+        if (!matches[s])
+            continue;
+        for (p = 0; p < pattern_count; p++)
+        {
+            if (matches[s] & (1u << p))
+            {
+                unsigned long hit = address + i + 1 - patterns[p].length;
+                printf("%08lx %s\n", hit, patterns[p].name);
+                hit_count++;
+                if (window_size)
+                    print_window(hit, patterns[p].length);
+            }
+        }
+    }
+    search_state = s;
+}
+
+// Passes a chunk read from address to everything that needs it
+int process_chunk(unsigned long address, const unsigned char far* data, unsigned size)
+{
+    if (hashing)
+    {
+        crc32_update(&crc, data, size);
+        sha1_update(&sha1, data, size);
+    }
+    if (finding)
+        search_chunk(address, data, size);
+    if (verify_file >= 0 && verify_chunk(address, data, size) < 0)
+        return -1;
+    if (outfile >= 0 && output(data, size) < 0)
+    {
+        fputs("write error\n", stderr);
+        return -1;
+    }
+    if (outfile >= 0 && ++chunks_written % COMMIT_INTERVAL == 0)
+        _dos_commit(outfile);
+    return 0;
+}
+
+int progress = 0;
+unsigned long total_bytes;      // in all ranges
+unsigned long done_bytes;       // including those skipped by -resume
+unsigned long processed_bytes;  // read in this run
+unsigned long start_ticks, read_ticks, process_ticks;
+
+void show_progress(void)
+{
+    if (!progress)
+        return;
+    fprintf(stderr, "\r%lu of %lu KB, %lu KB/s ", done_bytes / 1024, total_bytes / 1024,
+            kb_per_second(processed_bytes, bios_ticks() - start_ticks));
+}
+
+// Reads from the source and passes the data on, keeping track of the time
+// spent in both steps to tell whether reading or writing is slower.
+void timed_read(unsigned long dest, void far* buffer, unsigned long src, unsigned size)
+{
+    unsigned long t = bios_ticks();
+    if (buffer)
+        extread(buffer, src, size);
+    else
+        extcopy(dest, src, size);
+    read_ticks += bios_ticks() - t;
+}
+
+int timed_process(unsigned long address, unsigned size)
+{
+    unsigned long t = bios_ticks();
+    int status = process_chunk(address, transfer_buffer, size);
+    process_ticks += bios_ticks() - t;
+    done_bytes += size;
+    processed_bytes += size;
+    show_progress();
+    return status;
+}
+
+unsigned chunk_size(unsigned long remaining)
+{
+    return remaining > TRANSFER_SIZE ? TRANSFER_SIZE : (unsigned)remaining;
+}
+
+// Reads size bytes starting at base and passes them to process_chunk. If
+// there is an XMS block, it is filled from the source first and then
+// processed in one go, so reading the source and writing to disk don't
+// interleave.
+int dump_range(unsigned long base, unsigned long size)
+{
+    unsigned long batch, done;
+    unsigned chunk;
+    while (size > 0)
+    {
+        if (staging_size == 0)
+        {
+            chunk = chunk_size(size);
+            timed_read(0, transfer_buffer, base, chunk);
+            if (timed_process(base, chunk) < 0)
+                return -1;
+            base += chunk;
+            size -= chunk;
+            continue;
+        }
+        batch = size > staging_size ? staging_size : size;
+        for (done = 0; done < batch; done += chunk)
+        {
+            chunk = chunk_size(batch - done);
+            timed_read(staging_address + done, NULL, base + done, chunk);
+        }
+        for (done = 0; done < batch; done += chunk)
+        {
+            chunk = chunk_size(batch - done);
+            extread(transfer_buffer, staging_address + done, chunk);
+            if (timed_process(base + done, chunk) < 0)
+                return -1;
+        }
+        base += batch;
+        size -= batch;
+    }
+    return 0;
+}
+
+struct range {
+    unsigned long start;
     unsigned long size;
+};
+
+struct range *ranges = NULL;
+int range_count = 0;
+int range_capacity = 0;
+
+// Functions whose memory decoding has been turned on to dump one of their
+// BARs or their expansion ROM. The registers are restored at exit.
+#define MAX_DECODE 8
+struct decode {
+    dev_addr dev;
+    unsigned command;
+    unsigned rom_reg;           // 0 if the ROM BAR is untouched
+    unsigned long rom_bar;
+} decoding[MAX_DECODE];
+int decode_count = 0;
+
+void restore_decoding(void)
+{
+    struct decode *d;
+    while (decode_count > 0)
+    {
+        d = &decoding[--decode_count];
+        pci_write_word(d->dev, 4, d->command);
+        if (d->rom_reg)
+            pci_write_dword(d->dev, d->rom_reg, d->rom_bar);
+    }
+}
+
+struct decode *enable_decoding(dev_addr dev)
+{
+    struct decode *d;
+    int i;
+    for (i = 0; i < decode_count; i++)
+    {
+        if (decoding[i].dev == dev)
+            return &decoding[i];
+    }
+    if (decode_count == MAX_DECODE)
+    {
+        fputs("too many PCI functions\n", stderr);
+        return NULL;
+    }
+    d = &decoding[decode_count];
+    if (pci_read_word(dev, 4, &d->command) < 0)
+        return NULL;
+    if (decode_count++ == 0)
+        atexit(restore_decoding);
+    d->dev = dev;
+    d->rom_reg = 0;
+    if (!(d->command & CMD_MEM) && pci_write_word(dev, 4, d->command | CMD_MEM) < 0)
+        return NULL;
+    return d;
+}
+
+int force_rom = 0;      // may map a ROM over another BAR of the function
+
+// Enables the expansion ROM of the function "bb:dd.f$rom" and returns the
+// address and size of the ROM window.
+int map_rom(const char *spec, unsigned long *address, unsigned long *window)
+{
+    char dummy;
+    unsigned bus, dev, fn, reg;
+    dev_addr addr;
+    struct decode *d;
+    if (strlen(spec) != 11 || spec[2] != ':' || spec[5] != '.' || strcmp(spec + 7, "$rom") != 0 ||
+        sscanf(spec, "%x:%x.%u%c", &bus, &dev, &fn, &dummy) != 4 || dev > 31 || fn > 7)
+    {
+        return -1;
+    }
+    if (pci_init() < 0)
+    {
+        fputs("No PCI BIOS found\n", stderr);
+        return -1;
+    }
+    addr = ADDR(bus, dev, fn);
+    if (pci_rom_window(addr, force_rom, &reg, address, window) < 0)
+        return -1;
+    d = enable_decoding(addr);
+    if (!d)
+        return -1;
+    if (!d->rom_reg)
+    {
+        if (pci_read_dword(addr, reg, &d->rom_bar) < 0)
+            return -1;
+        d->rom_reg = reg;
+    }
+    return pci_write_dword(addr, reg, *address | 1);
+}
+
+// Follows the chain of images in an expansion ROM and returns their total
+// length. Each image starts with 55 AA and has the offset of its "PCIR" data
+// structure at 18h, which holds the image length in 512 byte units at 10h
+// and the last image flag in bit 7 of 15h.
+unsigned long rom_length(unsigned long address, unsigned long window)
+{
+    unsigned char header[0x1A];
+    unsigned char pcir[0x16];
+    unsigned long offset = 0;
+    unsigned long length;
+    unsigned pointer;
+    while (offset + sizeof header <= window)
+    {
+        extread(header, address + offset, sizeof header);
+        if (header[0] != 0x55 || header[1] != 0xAA)
+            break;
+        pointer = header[0x18] | (header[0x19] << 8);
+        if (offset + pointer + sizeof pcir > window)
+            break;
+        extread(pcir, address + offset + pointer, sizeof pcir);
+        length = (pcir[0x10] | (pcir[0x11] << 8)) * 512UL;
+        if (memcmp(pcir, "PCIR", 4) != 0 || length == 0)
+            break;
+        offset += length;
+        if (pcir[0x15] & 0x80)
+            break;
+    }
+    return offset < window ? offset : window;
+}
+
+// The start is a hex address, "bb:dd.f$b+offset" in memory BAR b of a PCI
+// function or "bb:dd.f$rom" for its expansion ROM. After a BAR, the size "*"
+// extends to the end of the BAR, after a ROM to the end of the last image.
+int add_range(const char *start_text, const char *size_text)
+{
+    unsigned long base, size;
+    unsigned long limit = 0;
     unsigned char dummy;
-    if (argc != 4)
+    dev_addr dev;
+    size_t length = strlen(start_text);
+    int rom = length > 4 && strcmp(start_text + length - 4, "$rom") == 0;
+    if (rom)
+    {
+        if (map_rom(start_text, &base, &limit) < 0)
+        {
+            fprintf(stderr, "bad expansion ROM %s\n", start_text);
+            return -1;
+        }
+    }
+    else if (strchr(start_text, '$'))
+    {
+        switch (pci_bar_region(start_text, &dev, &base, &limit))
+        {
+            case 0:
+                break;
+            case 1:
+                fputs("specified base address register describes an I/O region\n", stderr);
+                return -1;
+            default:
+                fprintf(stderr, "bad BAR address %s\n", start_text);
+                return -1;
+        }
+        if (!enable_decoding(dev))
+            return -1;
+    }
+    else if (sscanf(start_text, "%lx%c", &base, &dummy) != 1)
+    {
+        fprintf(stderr, "bad hex start address %s\n", start_text);
+        return -1;
+    }
+    if (rom && strcmp(size_text, "*") == 0)
+    {
+        size = rom_length(base, limit);
+        if (size == 0)
+        {
+            fprintf(stderr, "no ROM image in %s\n", start_text);
+            return -1;
+        }
+    }
+    else if (limit != 0 && strcmp(size_text, "*") == 0)
+        size = limit;
+    else if (sscanf(size_text, "%li%c", &size, &dummy) != 1)
+    {
+        fprintf(stderr, "bad size %s\n", size_text);
+        return -1;
+    }
+    if (limit != 0 && size > limit)
+    {
+        fprintf(stderr, "%s has only %lu bytes left\n", start_text, limit);
+        return -1;
+    }
+    if (size != 0 && base + size - 1 < base)
+    {
+        fprintf(stderr, "address overflow: %08lx bytes starting at %08lx\n", size, base);
+        return -1;
+    }
+    if (range_count == range_capacity)
+    {
+        struct range *grown;
+        range_capacity = range_capacity ? 2 * range_capacity : 8;
+        grown = realloc(ranges, range_capacity * sizeof *grown);
+        if (!grown)
+        {
+            fputs("out of memory\n", stderr);
+            return -1;
+        }
+        ranges = grown;
+    }
+    ranges[range_count].start = base;
+    ranges[range_count].size = size;
+    range_count++;
+    return 0;
+}
+
+// Reads pairs of start address and length, separated by white space.
+// '#' and ';' start a comment that extends to the end of the line.
+int read_range_file(const char *filename)
+{
+    char line[128];
+    char *word, *start = NULL;
+    char start_text[24];
+    int status = 0;
+    FILE *f = fopen(filename, "r");
+    if (!f)
+    {
+        perror(filename);
+        return -1;
+    }
+    while (status == 0 && fgets(line, sizeof line, f))
+    {
+        line[strcspn(line, "#;")] = '\0';
+        for (word = strtok(line, " \t\r\n"); word && status == 0; word = strtok(NULL, " \t\r\n"))
+        {
+            if (!start)
+            {
+                start_text[sizeof start_text - 1] = '\0';
+                start = strncpy(start_text, word, sizeof start_text - 1);
+            }
+            else
+            {
+                status = add_range(start, word);
+                start = NULL;
+            }
+        }
+    }
+    fclose(f);
+    if (status == 0 && start)
+    {
+        fprintf(stderr, "missing length after %s\n", start);
+        status = -1;
+    }
+    return status;
+}
+
+int compare_ranges(const void *a, const void *b)
+{
+    const struct range *ra = a, *rb = b;
+    if (ra->start != rb->start)
+        return ra->start < rb->start ? -1 : 1;
+    return 0;
+}
+
+// Sorts the ranges and joins overlapping or adjacent ones, so every byte is
+// read only once. Empty ranges are dropped.
+void merge_ranges(void)
+{
+    int in, out = 0;
+    qsort(ranges, range_count, sizeof *ranges, compare_ranges);
+    for (in = 0; in < range_count; in++)
+    {
+        const struct range *r = &ranges[in];
+        if (r->size == 0)
+            continue;
+        if (out > 0)
+        {
+            struct range *last = &ranges[out - 1];
+            unsigned long last_end = last->start + last->size - 1;
+            if (r->start <= last_end || r->start - 1 == last_end)
+            {
+                if (r->start + r->size - 1 > last_end)
+                    last->size = r->start + r->size - last->start;
+                continue;
+            }
+        }
+        ranges[out++] = *r;
+    }
+    range_count = out;
+}
+
+// Container file, all numbers little endian:
+//   header:  "MEMDUMP", version (1 byte), range count (2 bytes), reserved (2 bytes)
+//   table:   start address, length, file offset of the data (4 bytes each)
+//   data of all ranges
+#define CONTAINER_MAGIC "MEMDUMP"
+#define CONTAINER_VERSION 1
+#define CONTAINER_HEADER_SIZE 12
+#define CONTAINER_ENTRY_SIZE 12
+#define MAX_RANGES ((TRANSFER_SIZE - CONTAINER_HEADER_SIZE) / CONTAINER_ENTRY_SIZE)
+
+// Puts the range table into the transfer buffer and returns its size
+unsigned build_container_header(void)
+{
+    unsigned char far* p = transfer_buffer;
+    unsigned long offset;
+    unsigned size = CONTAINER_HEADER_SIZE + range_count * CONTAINER_ENTRY_SIZE;
+    int i;
+    _fmemcpy(p, CONTAINER_MAGIC, 7);
+    p[7] = CONTAINER_VERSION;
+    p[8] = (unsigned char)range_count;
+    p[9] = (unsigned char)(range_count >> 8);
+    p[10] = p[11] = 0;
+    offset = size;
+    for (i = 0; i < range_count; i++)
+    {
+        unsigned char far* entry = p + CONTAINER_HEADER_SIZE + i * CONTAINER_ENTRY_SIZE;
+        put_dword(entry, ranges[i].start);
+        put_dword(entry + 4, ranges[i].size);
+        put_dword(entry + 8, offset);
+        offset += ranges[i].size;
+    }
+    return size;
+}
+
+// Writes the range table, or compares it to the file in verify mode
+int output_container_header(void)
+{
+    unsigned char far* p = transfer_buffer;
+    unsigned size = build_container_header();
+    unsigned got;
+    if (verify_file >= 0)
+    {
+        if (_dos_read(verify_file, verify_buffer, size, &got) != 0 ||
+            got != size || _fmemcmp(verify_buffer, p, size) != 0)
+        {
+            puts("file has a different range table");
+            mismatch = 1;
+            return -1;
+        }
+        return 0;
+    }
+    if (output(p, size) < 0)
+    {
+        fputs("write error\n", stderr);
+        return -1;
+    }
+    return 0;
+}
+
+// BIOS.BIN -> BIOS.000, BIOS.001, ...
+void split_name(char *name, const char *filename, int index)
+{
+    char *dot;
+    strcpy(name, filename);
+    dot = strrchr(name, '.');
+    if (!dot || strpbrk(dot, "\\/:"))
+        dot = name + strlen(name);
+    sprintf(dot, ".%03d", index);
+}
+
+int open_file(const char *name, int verify)
+{
+    if (verify)
+    {
+        if (_dos_open(name, O_RDONLY, &verify_file) != 0)
+        {
+            perror(name);
+            return -1;
+        }
+    }
+    else if (_dos_creat(name, _A_NORMAL, &outfile) != 0)
+    {
+        perror(name);
+        return -1;
+    }
+    else if (rle && rle_start() < 0)
+    {
+        fputs("write error\n", stderr);
+        return -1;
+    }
+    return 0;
+}
+
+// With -resume, an existing output file is continued. Returns its length,
+// or -1 if it doesn't exist yet.
+long open_existing(const char *name)
+{
+    long length;
+    if (_dos_open(name, O_RDWR, &outfile) != 0)
+        return -1;
+    length = dos_seek(outfile, 0, SEEK_END);
+    if (length < 0)
+    {
+        _dos_close(outfile);
+        outfile = -1;
+    }
+    return length;
+}
+
+// A resumed container must have been started with the same ranges
+int check_container_header(void)
+{
+    unsigned size = build_container_header();
+    unsigned got;
+    if (dos_seek(outfile, 0, SEEK_SET) < 0 ||
+        _dos_read(outfile, verify_buffer, size, &got) != 0 || got != size ||
+        _fmemcmp(verify_buffer, transfer_buffer, size) != 0)
+        return -1;
+    return 0;
+}
+
+// In verify mode, the file must not be longer than what has been compared
+int close_file(int status)
+{
+    unsigned got;
+    if (verify_file >= 0)
+    {
+        if (status == 0 && _dos_read(verify_file, verify_buffer, 1, &got) == 0 && got != 0)
+        {
+            puts("file is longer than the memory dumped");
+            mismatch = 1;
+            status = -1;
+        }
+        _dos_close(verify_file);
+        verify_file = -1;
+    }
+    if (outfile >= 0)
+    {
+        if (rle && status == 0 && rle_finish() < 0)
+        {
+            fputs("write error\n", stderr);
+            status = -1;
+        }
+        if (_dos_close(outfile) != 0 && status == 0)
+        {
+            perror("closing output");
+            status = -1;
+        }
+        outfile = -1;
+    }
+    return status;
+}
+
+void print_hashes(const struct range *r, int with_range)
+{
+    unsigned char digest[20];
+    int i;
+    if (with_range)
+        printf("%08lx-%08lx ", r->start, r->start + r->size - 1);
+    printf("CRC32 %08lx%sSHA-1 ", crc32_final(&crc), with_range ? " " : "\n");
+    sha1_final(&sha1, digest);
+    for (i = 0; i < 20; i++)
+        printf("%02x", digest[i]);
+    putchar('\n');
+}
+
+// Ctrl-C must not skip the exit handlers that free the XMS block, restore
+// the PCI command registers and ROM BARs, and turn A20 back off
+void on_break(int sig)
+{
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    const char *filename = NULL;
+    char name[80];
+    unsigned long largest = 0;
+    int allow_unreal = 1;
+    int verify = 0;
+    int split = 0;
+    int resume = 0;
+    int container;
+    int status = 0;
+    unsigned long skip = 0;     // bytes already in the output file
+    long length;
+    int i;
+    if (argc == 4 && strcmp(argv[1], "-expand") == 0)
+    {
+        transfer_buffer = alloc_transfer_buffer();
+        if (!transfer_buffer)
+        {
+            fprintf(stderr, "out of memory");
+            return 1;
+        }
+        return expand_file(argv[2], argv[3]) < 0 ? 1 : 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "-b") == 0)
+    {
+        argc--;
+        argv++;
+        allow_unreal = 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "-hash") == 0)
+    {
+        argc--;
+        argv++;
+        hashing = 1;
+    }
+    else if (argc > 1 && strcmp(argv[1], "-verify") == 0)
+    {
+        argc--;
+        argv++;
+        verify = 1;
+    }
+    else if (argc > 2 && strcmp(argv[1], "-find") == 0)
+    {
+        if (parse_patterns(argv[2]) < 0 || build_automaton() < 0)
+            return 1;
+        argc -= 2;
+        argv += 2;
+        finding = 1;
+        if (argc > 2 && strcmp(argv[1], "-window") == 0)
+        {
+            char dummy;
+            int size;
+            if (sscanf(argv[2], "%i%c", &size, &dummy) != 1 || size < 0 || size > 256)
+            {
+                fprintf(stderr, "bad window size %s\n", argv[2]);
+                return 1;
+            }
+            window_size = size;
+            argc -= 2;
+            argv += 2;
+        }
+    }
+    if (argc > 1 && strcmp(argv[1], "-split") == 0)
+    {
+        argc--;
+        argv++;
+        split = 1;
+    }
+    if (argc > 1 && strcmp(argv[1], "-rle") == 0)
+    {
+        argc--;
+        argv++;
+        rle = 1;
+    }
+    if (argc > 1 && strcmp(argv[1], "-resume") == 0)
+    {
+        argc--;
+        argv++;
+        resume = 1;
+    }
+    if (argc > 1 && strcmp(argv[1], "-p") == 0)
+    {
+        argc--;
+        argv++;
+        progress = 1;
+    }
+    if (argc > 1 && strcmp(argv[1], "-force") == 0)
+    {
+        argc--;
+        argv++;
+        force_rom = 1;
+    }
+    // the file name is optional with -hash, ranges come in pairs
+    if (argc > 1 && (argv[argc - 1][0] == '@' ? argc == 3 : argc % 2 == 0))
+    {
+        filename = argv[1];
+        argc--;
+        argv++;
+    }
+    if ((argc < 3 && !(argc == 2 && argv[1][0] == '@')) ||
+        (!filename && (!(hashing || finding) || split)))
     {
         puts("DUMPMEM - linear memory dumping utility, (C) 2022 Michael Karcher\n"
              "Distributable under the MIT license - no warranty included\n"
-             "DUMPMEM <filename> <startaddress> <length>\n"
+             "DUMPMEM [-b] [-hash|-verify|-find <patterns> [-window <n>]] [-split] [-rle]\n"
+             "        [-resume] [-p] [-force] <filename> <ranges>\n"
+             "DUMPMEM [-b] -hash|-find <patterns> [-window <n>] [-p] [-force] <ranges>\n"
+             "DUMPMEM -expand <rlefile> <filename>\n"
+             "  -b       - use the BIOS copy function even if unreal mode is possible\n"
+             "  -hash    - print CRC32 and SHA-1 of each range\n"
+             "  -verify  - compare memory to the file(s) instead of writing\n"
+             "  -find    - print the addresses of the comma separated patterns,\n"
+             "             \\xx is the byte with hex value xx, e.g. $PIR,_MP_,\\55\\AA\n"
+             "  -window  - also dump n bytes before and after each pattern found\n"
+             "  -split   - one file per range: FILE.000, FILE.001, ...\n"
+             "  -rle     - compress runs of equal bytes, -expand restores the raw file\n"
+             "  -resume  - continue an interrupted dump at the end of the existing file\n"
+             "  -p       - show progress and read/write speed\n"
+             "  -force   - map an expansion ROM without a free address over a BAR\n"
              "  filename - name of file to be written\n"
-             "  address  - linear start address (hex)\n"
-             "  length   - length (C like integer, start with 0x for hex)");
+             "  ranges   - <startaddress> <length> [<startaddress> <length>]*\n"
+             "             or @<file> with pairs of start address and length\n"
+             "  address  - linear start address (hex), or bb:dd.f$bar+offset (hex)\n"
+             "             in a memory BAR of a PCI function, or bb:dd.f$rom for\n"
+             "             its expansion ROM\n"
+             "  length   - length (C like integer, start with 0x for hex),\n"
+             "             * for the rest of the BAR or all images in the ROM\n"
+             "  Overlapping ranges are merged. Multiple ranges without -split are\n"
+             "  stored in a single file with a range table in front of the data.");
         return 0;
     }
-    if (sscanf(argv[2], "%lx%c", &base, &dummy) != 1)
+    if (rle && verify)
     {
-        fprintf(stderr, "bad hex start address %s\n", argv[2]);
+        fputs("-verify needs an expanded file\n", stderr);
         return 1;
     }
-    if (sscanf(argv[3], "%li%c", &size, &dummy) != 1)
+    if (resume && (hashing || verify || finding || rle))
     {
-        fprintf(stderr, "bad size %s\n", argv[3]);
+        fputs("-resume only works for uncompressed dumps\n", stderr);
         return 1;
     }
-    if (size != 0 && base + size - 1 < base)
+    // the length of expansion ROMs is read while parsing the ranges
+    signal(SIGINT, on_break);
+    extmem_init(allow_unreal);
+    if (argv[1][0] == '@')
     {
-        fprintf(stderr, "address overflow: %08lx bytes starting at %08lx\n", size, base);
+        if (read_range_file(argv[1] + 1) < 0)
+            return 1;
+    }
+    else
+    {
+        for (i = 1; i < argc; i += 2)
+        {
+            if (add_range(argv[i], argv[i + 1]) < 0)
+                return 1;
+        }
+    }
+    container = !split && (range_count > 1 || argv[1][0] == '@');
+    merge_ranges();
+    if (range_count > (int)MAX_RANGES || (split && range_count > 1000))
+    {
+        fputs("too many ranges\n", stderr);
         return 1;
     }
-    buffer = malloc(bufsize);
-    if (!buffer)
+    if (filename && strlen(filename) > sizeof name - 5)
     {
-        fprintf(stderr, "out of memory");
+        fprintf(stderr, "file name %s too long\n", filename);
         return 1;
     }
-    outfile = fopen(argv[1], "wb");
-    if (!outfile)
+    for (i = 0; i < range_count; i++)
+    {
+        if (ranges[i].size > largest)
+            largest = ranges[i].size;
+        total_bytes += ranges[i].size;
+    }
+
+    transfer_buffer = alloc_transfer_buffer();
+    if (verify || resume)
+        verify_buffer = alloc_transfer_buffer();
+    if (rle)
+        rle_buffer = alloc_transfer_buffer();
+    if (!transfer_buffer || ((verify || resume) && !verify_buffer) || (rle && !rle_buffer))
     {
-        perror(argv[1]);
+        fprintf(stderr, "out of memory");
         return 1;
     }
-    while (size > bufsize)
+    if (largest > TRANSFER_SIZE)
+    {
+        unsigned long kb = (largest + 1023) / 1024;
+        staging_size = 1024UL * xms_alloc(kb > 0xFFFF ? 0xFFFF : (unsigned)kb, &staging_address);
+    }
+
+    start_ticks = bios_ticks();
+    if (filename && !split)
     {
-        extread(buffer, base, bufsize);
-        if (fwrite(buffer, 1, bufsize, outfile) != bufsize)
+        length = resume ? open_existing(filename) : -1;
+        if (length < 0)
         {
-            fprintf(stderr, "write error");
-            fclose(outfile);
-            return 1;
+            if (open_file(filename, verify) < 0)
+                return 1;
+            if (container)
+                status = output_container_header();
         }
-        size -= bufsize;
-        base += bufsize;
+        else if (container && length < (long)build_container_header())
+        {
+            // interrupted while writing the range table
+            if (dos_seek(outfile, 0, SEEK_SET) < 0)
+                status = -1;
+            else
+                status = output_container_header();
+        }
+        else if (container)
+        {
+            if (check_container_header() < 0)
+            {
+                fprintf(stderr, "%s has a different range table\n", filename);
+                close_file(-1);
+                return 1;
+            }
+            skip = length - build_container_header();
+            if (dos_seek(outfile, length, SEEK_SET) < 0)
+                status = -1;
+        }
+        else
+            skip = length;
     }
-    extread(buffer, base, size);
-    if (fwrite(buffer, 1, size, outfile) != size)
+    for (i = 0; i < range_count && status == 0; i++)
     {
-        fprintf(stderr, "write error");
-        fclose(outfile);
-        return 1;
+        unsigned long start = ranges[i].start;
+        unsigned long size = ranges[i].size;
+        if (split)
+        {
+            split_name(name, filename, i);
+            length = resume ? open_existing(name) : -1;
+            if (length < 0 && open_file(name, verify) < 0)
+                return 1;
+            skip = length < 0 ? 0 : length;
+        }
+        if (skip > 0)
+        {
+            unsigned long present = skip < size ? skip : size;
+            start += present;
+            size -= present;
+            skip -= present;
+            done_bytes += present;
+        }
+        if (hashing)
+        {
+            crc32_init(&crc);
+            sha1_init(&sha1);
+        }
+        search_state = 0;
+        status = dump_range(start, size);
+        if (split)
+            status = close_file(status);
+        if (hashing && status == 0)
+            print_hashes(&ranges[i], range_count > 1);
     }
-    if (fclose(outfile) < 0)
+    if (filename && !split)
+        status = close_file(status);
+    if (progress)
     {
-        perror("closing output");
-        return 1;
+        fprintf(stderr, "\nreading %lu KB/s, writing %lu KB/s\n",
+                kb_per_second(processed_bytes, read_ticks),
+                kb_per_second(processed_bytes, process_ticks));
     }
+    if (mismatch)
+        return 2;
+    if (status < 0)
+        return 1;
+    if (verify)
+        puts("memory matches file");
+    if (finding)
+        printf("%lu matches\n", hit_count);
     return 0;
-}
\ No newline at end of file
+}
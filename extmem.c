@@ -0,0 +1,433 @@
+// Access to memory at arbitrary physical addresses from real mode.
+//
+// The BIOS block move (INT 15h AH=87h) switches to protected mode and back
+// for every call, and some BIOSes toggle A20 each time as well. On a 386 in
+// real mode, loading FS with a 4GB descriptor once in protected mode keeps
+// that limit after switching back ("unreal mode"), so plain 32-bit string
+// moves reach all of memory. Under V86 mode (EMM386, Windows) this is not
+// possible and the BIOS function is used.
+#include <dos.h>
+#include <stdlib.h>
+#include <string.h>
+#include "extmem.h"
+
+#ifdef __WATCOMC__
+
+#define asm _asm
+
+#endif
+
+// Interrupts are disabled while copying, so large blocks are split
+#define UNREAL_CHUNK 0x1000
+
+int extmem_engine = EXTMEM_INT15;
+
+// null descriptor, data segment with base 0, limit 4GB
+static unsigned short unreal_gdt[8] = {
+    0, 0, 0, 0,
+    0xFFFF, 0, 0x9200, 0x008F
+};
+static unsigned short unreal_gdtr[3];
+static unsigned short saved_gdtr[3];     // restored after switching back
+
+static unsigned long linear(void far* p)
+{
+    return (((unsigned long)FP_SEG(p)) << 4) + FP_OFF(p);
+}
+
+static void int15_copy(unsigned long dest, unsigned long src, unsigned size)
+{
+    unsigned short gdt[8*4];    // 8 descriptors, 4 words each
+    union REGS r;
+    struct SREGS sr;
+    gdt[8] = 0xFFFF;            // src limit
+    gdt[9] = src & 0xFFFF;
+    gdt[10] = ((src >> 16) & 0xFF) | 0x9300;
+    gdt[11] = (src >> 16) & 0xFF00;
+
+    gdt[12] = 0xFFFF;           // dst limit
+    gdt[13] = dest & 0xFFFF;
+    gdt[14] = ((dest >> 16) & 0xFF) | 0x9300;
+    gdt[15] = (dest >> 16) & 0xFF00;
+
+    r.h.ah = 0x87;
+    r.x.cx = size / 2;
+    r.x.si = FP_OFF((void far*)gdt);
+    segread(&sr);
+    sr.es = sr.ss;
+    int86x(0x15, &r, &r, &sr);
+}
+
+// Reloads the 4GB limit of FS and ES on every call, as an interrupt handler
+// or memory manager might have switched to protected mode and back meanwhile.
+// The GDTR of whoever set it up before is put back afterwards.
+static void unreal_copy(unsigned long dest, unsigned long src, unsigned size)
+{
+    asm {
+        push es
+        pushf
+        cli
+        lea bx, saved_gdtr
+        db 66h, 0Fh, 01h, 07h       // sgdt [bx], with all 32 base bits
+        lea bx, unreal_gdtr
+        db 0Fh, 01h, 17h            // lgdt [bx]
+        db 0Fh, 20h, 0C0h           // mov eax, cr0
+        or al, 1
+        db 0Fh, 22h, 0C0h           // mov cr0, eax
+        mov bx, 8
+        db 8Eh, 0E3h                // mov fs, bx
+        mov es, bx
+        and al, 0FEh
+        db 0Fh, 22h, 0C0h           // mov cr0, eax
+        xor bx, bx
+        db 8Eh, 0E3h                // mov fs, bx
+        mov es, bx
+        lea bx, saved_gdtr
+        db 66h, 0Fh, 01h, 17h       // lgdt [bx], with all 32 base bits
+        db 66h
+        mov di, [WORD PTR dest]
+        db 66h
+        mov si, [WORD PTR src]
+        mov cx, [size]
+        shr cx, 1
+        shr cx, 1
+        db 66h, 0Fh, 0B7h, 0C9h     // movzx ecx, cx
+        cld
+        db 0F3h, 64h, 66h, 67h, 0A5h    // rep movsd es:[edi], fs:[esi]
+        mov cx, [size]
+        and cx, 3
+        db 0F3h, 64h, 67h, 0A4h     // rep movsb es:[edi], fs:[esi]
+        popf
+        pop es
+    }
+}
+
+// Gives FS a 4GB limit with base 0. Interrupts must stay disabled until the
+// access through FS is done.
+static void unreal_load_fs(void)
+{
+    asm {
+        lea bx, saved_gdtr
+        db 66h, 0Fh, 01h, 07h       // sgdt [bx], with all 32 base bits
+        lea bx, unreal_gdtr
+        db 0Fh, 01h, 17h            // lgdt [bx]
+        db 0Fh, 20h, 0C0h           // mov eax, cr0
+        or al, 1
+        db 0Fh, 22h, 0C0h           // mov cr0, eax
+        mov bx, 8
+        db 8Eh, 0E3h                // mov fs, bx
+        and al, 0FEh
+        db 0Fh, 22h, 0C0h           // mov cr0, eax
+        xor bx, bx
+        db 8Eh, 0E3h                // mov fs, bx
+        lea bx, saved_gdtr
+        db 66h, 0Fh, 01h, 17h       // lgdt [bx], with all 32 base bits
+    }
+}
+
+static unsigned long unreal_peek(unsigned long address, unsigned width)
+{
+    unsigned long value = 0;
+    _disable();
+    unreal_load_fs();
+    switch (width)
+    {
+        case 1:
+            asm {
+                db 66h
+                mov si, [WORD PTR address]
+                db 64h, 67h, 8Ah, 06h       // mov al, fs:[esi]
+                mov [BYTE PTR value], al
+            }
+            break;
+        case 2:
+            asm {
+                db 66h
+                mov si, [WORD PTR address]
+                db 64h, 67h, 8Bh, 06h       // mov ax, fs:[esi]
+                mov [WORD PTR value], ax
+            }
+            break;
+        default:
+            asm {
+                db 66h
+                mov si, [WORD PTR address]
+                db 66h, 64h, 67h, 8Bh, 06h  // mov eax, fs:[esi]
+                db 66h
+                mov [WORD PTR value], ax
+            }
+            break;
+    }
+    _enable();
+    return value;
+}
+
+static void unreal_poke(unsigned long address, unsigned long value, unsigned width)
+{
+    _disable();
+    unreal_load_fs();
+    switch (width)
+    {
+        case 1:
+            asm {
+                db 66h
+                mov si, [WORD PTR address]
+                mov al, [BYTE PTR value]
+                db 64h, 67h, 88h, 06h       // mov fs:[esi], al
+            }
+            break;
+        case 2:
+            asm {
+                db 66h
+                mov si, [WORD PTR address]
+                mov ax, [WORD PTR value]
+                db 64h, 67h, 89h, 06h       // mov fs:[esi], ax
+            }
+            break;
+        default:
+            asm {
+                db 66h
+                mov si, [WORD PTR address]
+                db 66h
+                mov ax, [WORD PTR value]
+                db 66h, 64h, 67h, 89h, 06h  // mov fs:[esi], eax
+            }
+            break;
+    }
+    _enable();
+}
+
+// 8086: bits 12..15 of FLAGS always set, 286 in real mode: always clear
+int cpu_level(void)
+{
+    unsigned low, high;
+    asm {
+        pushf
+        pushf
+        pop ax
+        and ax, 0FFFh
+        push ax
+        popf
+        pushf
+        pop bx
+        or ax, 7000h
+        push ax
+        popf
+        pushf
+        pop ax
+        popf
+        mov [low], bx
+        mov [high], ax
+    }
+    if ((low & 0xF000) == 0xF000)
+        return 0;
+    return (high & 0x7000) != 0 ? 3 : 2;
+}
+
+static int in_v86_mode(void)
+{
+    unsigned msw;
+    asm {
+        db 0Fh, 01h, 0E0h           // smsw ax
+        mov [msw], ax
+    }
+    return msw & 1;
+}
+
+// Compares linear address 000200 (INT 80h vector) with 100200
+static int a20_enabled(void)
+{
+    unsigned far* low = MK_FP(0, 0x200);
+    unsigned far* high = MK_FP(0xFFFF, 0x210);
+    unsigned saved;
+    int enabled;
+    _disable();
+    saved = *low;
+    *low = ~*high;
+    enabled = *low != *high;
+    *low = saved;
+    _enable();
+    return enabled;
+}
+
+// A20 is turned off again at exit if extmem_init turned it on
+static int a20_restore_pending = 0;
+
+static void a20_restore(void)
+{
+    union REGS r;
+    r.x.ax = 0x2400;
+    int86(0x15, &r, &r);
+}
+
+// Memory above the HMA, out of reach of real mode segments
+#define PROBE_ABOVE_1MB 0x110000UL
+
+// Selects the copy engine. Unreal mode is only used if it is available and
+// reads the same as the BIOS entry point through a real mode pointer, and
+// memory above 1MB (with A20 on) like the BIOS copy function does.
+int extmem_init(int allow_unreal)
+{
+    unsigned char probe[16];
+    unsigned char expected[16];
+    unsigned long gdt_lin;
+    int a20_was_on;
+    union REGS r;
+    extmem_engine = EXTMEM_INT15;
+    if (!allow_unreal || cpu_level() < 3 || in_v86_mode())
+        return extmem_engine;
+    // some BIOSes turn A20 off in the copy function, even if it was on
+    a20_was_on = a20_enabled();
+    int15_copy(linear((void far*)expected), PROBE_ABOVE_1MB, sizeof expected);
+    if (!a20_enabled())
+    {
+        if (!a20_was_on)
+        {
+            r.x.ax = 0x2402;        // query, to put the BIOS state back at exit
+            int86(0x15, &r, &r);
+            a20_was_on = !r.x.cflag && r.h.al != 0;
+        }
+        r.x.ax = 0x2401;
+        int86(0x15, &r, &r);
+        if (!a20_enabled())
+            return extmem_engine;
+        if (!a20_was_on && !a20_restore_pending)
+        {
+            a20_restore_pending = 1;
+            atexit(a20_restore);
+        }
+    }
+    gdt_lin = linear((void far*)unreal_gdt);
+    unreal_gdtr[0] = sizeof unreal_gdt - 1;
+    unreal_gdtr[1] = (unsigned short)gdt_lin;
+    unreal_gdtr[2] = (unsigned short)(gdt_lin >> 16);
+    unreal_copy(linear((void far*)probe), 0xFFFF0UL, sizeof probe);
+    if (_fmemcmp(probe, MK_FP(0xF000, 0xFFF0), sizeof probe) != 0)
+        return extmem_engine;
+    unreal_copy(linear((void far*)probe), PROBE_ABOVE_1MB, sizeof probe);
+    if (memcmp(probe, expected, sizeof probe) == 0)
+        extmem_engine = EXTMEM_UNREAL;
+    return extmem_engine;
+}
+
+void extcopy(unsigned long dest, unsigned long src, size_t size)
+{
+    if (extmem_engine == EXTMEM_UNREAL)
+    {
+        while (size > UNREAL_CHUNK)
+        {
+            unreal_copy(dest, src, UNREAL_CHUNK);
+            dest += UNREAL_CHUNK;
+            src += UNREAL_CHUNK;
+            size -= UNREAL_CHUNK;
+        }
+        unreal_copy(dest, src, size);
+        return;
+    }
+    int15_copy(dest, src, size & ~1);
+    // the BIOS moves words only, so merge the last byte into a word
+    if (size & 1)
+    {
+        unsigned char tail[2], last[2];
+        int15_copy(linear((void far*)tail), src + size - 1, 2);
+        int15_copy(linear((void far*)last), dest + size - 1, 2);
+        last[0] = tail[0];
+        int15_copy(dest + size - 1, linear((void far*)last), 2);
+    }
+}
+
+void extread(void far* dest, unsigned long src, size_t size)
+{
+    extcopy(linear(dest), src, size);
+}
+
+int extpeek(unsigned long address, unsigned width, unsigned long* value)
+{
+    if (extmem_engine == EXTMEM_UNREAL)
+    {
+        *value = unreal_peek(address, width);
+        return 0;
+    }
+    if (width != 2)
+        return -1;
+    *value = 0;
+    extread((void far*)value, address, 2);
+    return 0;
+}
+
+int extpoke(unsigned long address, unsigned long value, unsigned width)
+{
+    if (extmem_engine == EXTMEM_UNREAL)
+    {
+        unreal_poke(address, value, width);
+        return 0;
+    }
+    if (width != 2)
+        return -1;
+    int15_copy(address, linear((void far*)&value), 2);
+    return 0;
+}
+
+static void far* xms_entry;
+static unsigned xms_handle;
+static int xms_allocated = 0;
+
+// Calls the XMS driver, function in AH, argument in DX
+static unsigned xms_call(unsigned function, unsigned arg, unsigned *result_bx, unsigned *result_dx)
+{
+    unsigned out_ax, out_bx, out_dx;
+    asm {
+        mov ax, [function]
+        mov dx, [arg]
+        call dword ptr [xms_entry]
+        mov [out_ax], ax
+        mov [out_bx], bx
+        mov [out_dx], dx
+    }
+    if (result_bx)
+        *result_bx = out_bx;
+    if (result_dx)
+        *result_dx = out_dx;
+    return out_ax;
+}
+
+void xms_release(void)
+{
+    if (!xms_allocated)
+        return;
+    xms_call(0x0D00, xms_handle, NULL, NULL);     // unlock
+    xms_call(0x0A00, xms_handle, NULL, NULL);     // free
+    xms_allocated = 0;
+}
+
+unsigned xms_alloc(unsigned max_kb, unsigned long *address)
+{
+    union REGS r;
+    struct SREGS sr;
+    unsigned kb, low, high;
+    if (xms_allocated)
+        return 0;
+    r.x.ax = 0x4300;
+    int86(0x2F, &r, &r);
+    if (r.h.al != 0x80)
+        return 0;
+    r.x.ax = 0x4310;
+    segread(&sr);
+    int86x(0x2F, &r, &r, &sr);
+    xms_entry = MK_FP(sr.es, r.x.bx);
+
+    kb = xms_call(0x0800, 0, NULL, NULL);        // largest free block
+    if (kb > max_kb)
+        kb = max_kb;
+    if (kb == 0 || xms_call(0x0900, kb, NULL, &xms_handle) != 1)
+        return 0;
+    if (xms_call(0x0C00, xms_handle, &low, &high) != 1)
+    {
+        xms_call(0x0A00, xms_handle, NULL, NULL);
+        return 0;
+    }
+    xms_allocated = 1;
+    atexit(xms_release);
+    *address = ((unsigned long)high << 16) | low;
+    return kb;
+}
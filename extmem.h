@@ -0,0 +1,26 @@
+#include <stddef.h>
+
+// Ways of reading memory above 1MB, see extmem_init
+#define EXTMEM_INT15  0     // BIOS block move, INT 15h AH=87h
+#define EXTMEM_UNREAL 1     // 32-bit moves through FS with a 4GB limit
+
+extern int extmem_engine;
+
+// 0 for an 8086/8088 or 80186, 2 for a 286, 3 for a 386 or newer
+int cpu_level(void);
+
+int extmem_init(int allow_unreal);
+void extcopy(unsigned long dest, unsigned long src, size_t size);
+void extread(void far* dest, unsigned long src, size_t size);
+
+// Single accesses of 1, 2 or 4 bytes, e.g. to memory mapped registers. In
+// unreal mode, every access is one instruction of that width. The BIOS
+// function moves words, which may be split or merged, so only word accesses
+// are possible with it; other widths return -1 without touching memory.
+int extpeek(unsigned long address, unsigned width, unsigned long* value);
+int extpoke(unsigned long address, unsigned long value, unsigned width);
+
+// Allocates and locks a single XMS block of at most max_kb KB, released at
+// exit. Returns its size in KB and the physical address, 0 without XMS.
+unsigned xms_alloc(unsigned max_kb, unsigned long *address);
+void xms_release(void);
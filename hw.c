@@ -1,6 +1,8 @@
 #include <conio.h>
+#include <dos.h>
 #include <string.h>
 #include <stdio.h>
+#include "extmem.h"
 #include "pci.h"
 
 #ifdef __WATCOMC__
@@ -9,31 +11,6 @@
 
 #endif
 
-void my_outpd(unsigned port, unsigned long value)
-{
-    asm {
-        mov dx, [port]
-        db 66h
-        mov ax, [WORD PTR value]
-        db 66h
-        out dx,ax
-    }
-}
-
-unsigned long my_inpd(unsigned port)
-{
-    asm {
-        mov dx, [port]
-        db 66h
-        in ax,dx
-        db 66h
-        mov dx,ax
-        mov cl,10h
-        db 66h
-        shr dx,cl
-    }
-}
-
 typedef struct {
     void (*writeb)(unsigned char value);
     void (*writew)(unsigned int value);
@@ -42,69 +19,31 @@ typedef struct {
     unsigned (*readw)();
     unsigned long (*readd)();
     int (*parse_address)(const char* addr);
+    // Optional: moves count items of width 1, 2 or 4 bytes between the
+    // address and a buffer, without advancing the address.
+    void (*readblock)(void* buffer, unsigned count, unsigned width);
+    void (*writeblock)(const void* buffer, unsigned count, unsigned width);
 } space_t;
 
 static unsigned parsed_io_address;
 int io_parse_address(const char* addr)
 {
     char dummy;
-    unsigned bus, dev, fn, bar;
-    unsigned long offset;
-    unsigned vendor;
+    unsigned long bar_addr;
     size_t addrlen = strlen(addr);
-    if (addrlen > 10 && addrlen <= 12 &&
-        addr[2] == ':' && addr[5] == '.' && addr[7] == '$' && addr[9] == '+' &&
-        sscanf(addr, "%x:%x.%u$%u+%lx%c", &bus, &dev, &fn, &bar, &offset, &dummy) == 5)
+    if (addrlen > 10 && addrlen <= 12 && addr[7] == '$')
     {
-        dev_addr addr;
-        unsigned long bar_val;
-        if (pci_init() < 0)
+        switch (pci_bar_address(addr, &bar_addr))
         {
-            fputs("No PCI BIOS found\n", stderr);
-            return -1;
-        }
-        if (bus > last_bus)
-        {
-            fputs("Bad bus number\n", stderr);
-            return -1;            
-        }
-        if (dev > 31)
-        {
-            fputs("Invalid device number\n", stderr);
-            return -1;            
-        }
-        if (fn > 7)
-        {
-            fputs("Invalid function number\n", stderr);
-            return -1;            
-        }
-        if (bar > 5)
-        {
-            fputs("Invalid BAR number\n", stderr);
-            return -1;            
-        }
-        if (offset >= 0x100)
-        {
-            fputs("Invalid I/O offset (PCI I/O areas are 256 bytes maximum)\n", stderr);
-            return -1;
-        }
-        addr = ADDR(bus, dev, fn);
-        if (pci_read_word(addr, 0, &vendor) < 0 || vendor == 0xFFFF)
-        {
-            fputs("specified PCI device does not exist\n", stderr);
-            return -1;
-        }
-        if (pci_read_dword(addr, 0x10 + 4*bar, &bar_val) < 0 || bar_val == 0x00000000)
-        {
-            fputs("specified base address register does not exist\n", stderr);
-            return -1;
-        }
-        if (!(bar_val & 1))
-        {
-            fputs("specified base address register describes a memory mapped region\n", stderr);
-            return -1;
+            case 1:
+                break;
+            case 0:
+                fputs("specified base address register describes a memory mapped region\n", stderr);
+                return -1;
+            default:
+                return -1;
         }
-        parsed_io_address = (bar_val & ~1) + offset;
+        parsed_io_address = (unsigned)bar_addr;
         return 0;
     }
     else if (addrlen <= 4 && sscanf(addr, "%x%c", &parsed_io_address, &dummy) == 1)
@@ -145,18 +84,714 @@ unsigned long io_readd()
     return my_inpd(parsed_io_address);
 }
 
+// rep ins/outs are encoded by hand, as this file is compiled for the 8086.
+// On an 8086, these opcodes are conditional jumps, so it gets a loop of
+// single transfers instead; the 80186 is treated the same, as it can't be
+// told apart from an 8086 easily. Dwords need a 386, see main.
+void io_readblock(void* buffer, unsigned count, unsigned width)
+{
+    unsigned port = parsed_io_address;
+    unsigned i;
+    if (cpu_level() < 2)
+    {
+        for (i = 0; i < count; i++)
+        {
+            if (width == 1)
+                ((unsigned char*)buffer)[i] = inp(port);
+            else
+                ((unsigned*)buffer)[i] = inpw(port);
+        }
+        return;
+    }
+    switch (width)
+    {
+        case 1:
+            asm {
+                push es
+                push ds
+                pop es
+                mov dx, [port]
+                mov di, [buffer]
+                mov cx, [count]
+                cld
+                db 0F3h, 6Ch    // rep insb
+                pop es
+            }
+            break;
+        case 2:
+            asm {
+                push es
+                push ds
+                pop es
+                mov dx, [port]
+                mov di, [buffer]
+                mov cx, [count]
+                cld
+                db 0F3h, 6Dh    // rep insw
+                pop es
+            }
+            break;
+        case 4:
+            asm {
+                push es
+                push ds
+                pop es
+                mov dx, [port]
+                mov di, [buffer]
+                mov cx, [count]
+                cld
+                db 0F3h, 66h, 6Dh   // rep insd
+                pop es
+            }
+            break;
+    }
+}
+
+void io_writeblock(const void* buffer, unsigned count, unsigned width)
+{
+    unsigned port = parsed_io_address;
+    unsigned i;
+    if (cpu_level() < 2)
+    {
+        for (i = 0; i < count; i++)
+        {
+            if (width == 1)
+                outp(port, ((const unsigned char*)buffer)[i]);
+            else
+                outpw(port, ((const unsigned*)buffer)[i]);
+        }
+        return;
+    }
+    switch (width)
+    {
+        case 1:
+            asm {
+                mov dx, [port]
+                mov si, [buffer]
+                mov cx, [count]
+                cld
+                db 0F3h, 6Eh    // rep outsb
+            }
+            break;
+        case 2:
+            asm {
+                mov dx, [port]
+                mov si, [buffer]
+                mov cx, [count]
+                cld
+                db 0F3h, 6Fh    // rep outsw
+            }
+            break;
+        case 4:
+            asm {
+                mov dx, [port]
+                mov si, [buffer]
+                mov cx, [count]
+                cld
+                db 0F3h, 66h, 6Fh   // rep outsd
+            }
+            break;
+    }
+}
+
 static const space_t iospace = {
     io_writeb, io_writew, io_writed,
     io_readb, io_readw, io_readd,
-    io_parse_address
+    io_parse_address,
+    io_readblock, io_writeblock
 };
 
+// Registers behind an index/data port pair, like CMOS (70h/71h) or the VGA
+// sequencer (3C4h/3C5h). The data port follows the index port. Each access
+// selects the index and transfers the data with interrupts disabled, and
+// puts back the index that was selected before. The CMOS index ports 70h
+// and 72h are left alone: they are write-only on many chipsets, and bit 7
+// of 70h disables the NMI, so writing back what they read could leave the
+// NMI disabled.
+static unsigned parsed_index;
+
+static int index_readable(void)
+{
+    return parsed_io_address != 0x70 && parsed_io_address != 0x72;
+}
+
+void idx_writeb(unsigned char value)
+{
+    unsigned old;
+    _disable();
+    old = index_readable() ? inp(parsed_io_address) : 0;
+    outp(parsed_io_address, parsed_index);
+    outp(parsed_io_address + 1, value);
+    if (index_readable())
+        outp(parsed_io_address, old);
+    _enable();
+}
+
+unsigned idx_readb()
+{
+    unsigned old, value;
+    _disable();
+    old = index_readable() ? inp(parsed_io_address) : 0;
+    outp(parsed_io_address, parsed_index);
+    value = inp(parsed_io_address + 1);
+    if (index_readable())
+        outp(parsed_io_address, old);
+    _enable();
+    return value;
+}
+
+// byte registers only
+static const space_t idxspace = {
+    idx_writeb, NULL, NULL,
+    idx_readb, NULL, NULL,
+    io_parse_address,
+    NULL, NULL
+};
+
+// Physical memory. Below 1MB, accesses go through far pointers, above
+// through extpeek/extpoke, which need extmem_init. Without unreal mode,
+// only word accesses are possible above 1MB, see mem_access_possible.
+static unsigned long parsed_mem_address;
+static unsigned long parsed_mem_remaining;     // up to the end of a BAR
+static int parsed_mem_low;
+
+int mem_parse_address(const char* addr)
+{
+    char dummy;
+    dev_addr dev;
+    unsigned command;
+    parsed_mem_remaining = 0xFFFFFFFFUL;
+    if (strchr(addr, '$'))
+    {
+        switch (pci_bar_region(addr, &dev, &parsed_mem_address, &parsed_mem_remaining))
+        {
+            case 0:
+                break;
+            case 1:
+                fputs("specified base address register describes an I/O region\n", stderr);
+                return -1;
+            default:
+                return -1;
+        }
+        if (pci_read_word(dev, 4, &command) < 0 || !(command & CMD_MEM))
+        {
+            fputs("memory decoding of the specified PCI device is off\n", stderr);
+            return -1;
+        }
+    }
+    else if (strlen(addr) > 8 || sscanf(addr, "%lx%c", &parsed_mem_address, &dummy) != 1)
+    {
+        return -1;
+    }
+    parsed_mem_low = parsed_mem_address <= 0xFFFFCUL;
+    if (!parsed_mem_low)
+        extmem_init(1);
+    return 0;
+}
+
+static void far* mem_pointer(void)
+{
+    return MK_FP((unsigned)(parsed_mem_address >> 4), (unsigned)parsed_mem_address & 0xF);
+}
+
+void mem_writeb(unsigned char value)
+{
+    if (parsed_mem_low)
+        *(volatile unsigned char far*)mem_pointer() = value;
+    else
+        extpoke(parsed_mem_address, value, 1);
+}
+
+void mem_writew(unsigned int value)
+{
+    if (parsed_mem_low)
+        *(volatile unsigned far*)mem_pointer() = value;
+    else
+        extpoke(parsed_mem_address, value, 2);
+}
+
+// A C dword access would be split into two word accesses
+void mem_writed(unsigned long value)
+{
+    void far* p;
+    if (!parsed_mem_low)
+    {
+        extpoke(parsed_mem_address, value, 4);
+        return;
+    }
+    p = mem_pointer();
+    asm {
+        push es
+        les bx, [p]
+        db 66h
+        mov ax, [WORD PTR value]
+        db 66h
+        mov es:[bx], ax
+        pop es
+    }
+}
+
+unsigned mem_readb()
+{
+    unsigned long value;
+    if (parsed_mem_low)
+        return *(volatile unsigned char far*)mem_pointer();
+    extpeek(parsed_mem_address, 1, &value);
+    return (unsigned)value;
+}
+
+unsigned mem_readw()
+{
+    unsigned long value;
+    if (parsed_mem_low)
+        return *(volatile unsigned far*)mem_pointer();
+    extpeek(parsed_mem_address, 2, &value);
+    return (unsigned)value;
+}
+
+unsigned long mem_readd()
+{
+    unsigned long value;
+    void far* p;
+    if (!parsed_mem_low)
+    {
+        extpeek(parsed_mem_address, 4, &value);
+        return value;
+    }
+    p = mem_pointer();
+    asm {
+        push es
+        les bx, [p]
+        db 66h
+        mov ax, es:[bx]
+        db 66h
+        mov [WORD PTR value], ax
+        pop es
+    }
+    return value;
+}
+
+int mem_access_possible(unsigned width)
+{
+    if (width > parsed_mem_remaining)
+    {
+        fputs("access extends beyond the end of the base address register\n", stderr);
+        return 0;
+    }
+    if (width == 4 && cpu_level() < 3)
+    {
+        fputs("dword accesses need a 386 or newer\n", stderr);
+        return 0;
+    }
+    if (!parsed_mem_low && extmem_engine != EXTMEM_UNREAL && width != 2)
+    {
+        fputs("without unreal mode (e.g. under EMM386), only word accesses above 1MB are possible\n", stderr);
+        return 0;
+    }
+    return 1;
+}
+
+static const space_t memspace = {
+    mem_writeb, mem_writew, mem_writed,
+    mem_readb, mem_readw, mem_readd,
+    mem_parse_address,
+    NULL, NULL
+};
+
+// Parses "ii" or "ii..jj", two hex digits each
+int parse_index_range(const char* text, unsigned* first, unsigned* last)
+{
+    char dummy;
+    if (strlen(text) == 2 && sscanf(text, "%x%c", first, &dummy) == 1)
+    {
+        *last = *first;
+        return 0;
+    }
+    if (strlen(text) == 6 && text[2] == '.' && text[3] == '.' &&
+        sscanf(text, "%x..%x%c", first, last, &dummy) == 2 && *first <= *last)
+    {
+        return 0;
+    }
+    return -1;
+}
+
+// idxin <port> <ii>[..<jj>] prints one register or a table of several,
+// idxout <port> <ii>=<vv> [<ii>=<vv> ...] writes them in the given order.
+int indexed_access(const space_t* space, int write, int argc, char** argv)
+{
+    char dummy;
+    unsigned first, last, value;
+    unsigned index;
+    int i;
+    if (argc < 1)
+    {
+        fputs(write ? "missing index=value\n" : "missing index\n", stderr);
+        return -1;
+    }
+    if (write)
+    {
+        // check everything first, so a typo doesn't leave half of it written
+        for (i = 0; i < argc; i++)
+        {
+            if (strlen(argv[i]) != 5 || argv[i][2] != '=' ||
+                sscanf(argv[i], "%x=%x%c", &first, &value, &dummy) != 2)
+            {
+                fprintf(stderr, "Bad assignment %s, must be ii=vv\n", argv[i]);
+                return -1;
+            }
+        }
+        for (i = 0; i < argc; i++)
+        {
+            sscanf(argv[i], "%x=%x", &parsed_index, &value);
+            space->writeb(value);
+        }
+        return 0;
+    }
+    if (parse_index_range(argv[0], &first, &last) < 0)
+    {
+        fputs("Bad index, must be ii or ii..jj\n", stderr);
+        return -1;
+    }
+    if (first == last)
+    {
+        parsed_index = first;
+        printf("%02x\n", space->readb());
+        return 0;
+    }
+    for (index = first; index <= last; index++)
+    {
+        parsed_index = index;
+        value = space->readb();
+        if ((index - first) % 16 == 0)
+            printf("%02x:", index);
+        printf(" %02x", value);
+        if ((index - first) % 16 == 15 || index == last)
+            putchar('\n');
+    }
+    return 0;
+}
+
+unsigned size_width(char sizechar)
+{
+    switch (sizechar)
+    {
+        case 'b':
+            return 1;
+        case 'w':
+            return 2;
+        case 'd':
+        case 'l':
+            return 4;
+        default:
+            return 0;
+    }
+}
+
+#define BLOCK_SIZE 0x4000
+static unsigned char block[BLOCK_SIZE];
+
+// Reads count items from the address into a file
+int read_to_file(const space_t* space, unsigned width, unsigned long count, const char* filename)
+{
+    unsigned chunk;
+    FILE* f = fopen(filename, "wb");
+    if (!f)
+    {
+        perror(filename);
+        return -1;
+    }
+    while (count > 0)
+    {
+        chunk = count > BLOCK_SIZE / width ? BLOCK_SIZE / width : (unsigned)count;
+        space->readblock(block, chunk, width);
+        if (fwrite(block, width, chunk, f) != chunk)
+        {
+            fputs("write error\n", stderr);
+            fclose(f);
+            return -1;
+        }
+        count -= chunk;
+    }
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+// Writes a file to the address, its length must be a multiple of width
+int write_from_file(const space_t* space, unsigned width, const char* filename)
+{
+    size_t got;
+    long length;
+    FILE* f = fopen(filename, "rb");
+    if (!f)
+    {
+        perror(filename);
+        return -1;
+    }
+    if (fseek(f, 0, SEEK_END) != 0 || (length = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) != 0)
+    {
+        fputs("read error\n", stderr);
+        fclose(f);
+        return -1;
+    }
+    if (length % width != 0)
+    {
+        fprintf(stderr, "length of %s is not a multiple of %u\n", filename, width);
+        fclose(f);
+        return -1;
+    }
+    while ((got = fread(block, 1, BLOCK_SIZE, f)) > 0)
+        space->writeblock(block, got / width, width);
+    fclose(f);
+    return 0;
+}
+
+unsigned long read_item(const space_t* space, unsigned width)
+{
+    switch (width)
+    {
+        case 1:
+            return space->readb();
+        case 2:
+            return space->readw();
+        default:
+            return space->readd();
+    }
+}
+
+// Arguments of the dump verbs: <start> <end> [<file>] reads the ports from
+// start up to, but not including, end. <start>..<last> [<file>] includes
+// last. After "bb:dd.f$bar+offset", end and last are offsets into the BAR.
+int dump_ports(int argc, char** argv, unsigned width)
+{
+    char start_text[20];
+    char dummy;
+    const char* end_text;
+    const char* dots;
+    const char* filename = NULL;
+    const char* plus;
+    unsigned long end, limit, offset;
+    unsigned long length, value;
+    unsigned port;
+    unsigned i, byte;
+    FILE* out = NULL;
+
+    if (argc < 1)
+    {
+        fputs("missing port range\n", stderr);
+        return -1;
+    }
+    dots = strstr(argv[0], "..");
+    if (dots)
+    {
+        if (dots - argv[0] >= (int)sizeof start_text)
+        {
+            fputs("Bad address\n", stderr);
+            return -1;
+        }
+        memcpy(start_text, argv[0], dots - argv[0]);
+        start_text[dots - argv[0]] = '\0';
+        end_text = dots + 2;
+        if (argc > 1)
+            filename = argv[1];
+    }
+    else
+    {
+        if (argc < 2)
+        {
+            fputs("missing end of port range\n", stderr);
+            return -1;
+        }
+        strncpy(start_text, argv[0], sizeof start_text - 1);
+        start_text[sizeof start_text - 1] = '\0';
+        end_text = argv[1];
+        if (argc > 2)
+            filename = argv[2];
+    }
+    if (io_parse_address(start_text) < 0)
+    {
+        fputs("Bad address\n", stderr);
+        return -1;
+    }
+    port = parsed_io_address;
+    if (strlen(end_text) > 4 || sscanf(end_text, "%lx%c", &end, &dummy) != 1)
+    {
+        fputs("Bad end of port range\n", stderr);
+        return -1;
+    }
+    limit = 0x10000UL;
+    plus = strchr(start_text, '+');
+    if (strchr(start_text, '$') && plus && sscanf(plus + 1, "%lx", &offset) == 1)
+    {
+        // like io_parse_address, only the first 256 ports of an I/O BAR
+        limit = port - offset + 0x100;
+        end += port - offset;
+    }
+    if (dots)
+        end++;
+    if (end <= port || end > limit)
+    {
+        fputs("Bad port range\n", stderr);
+        return -1;
+    }
+    length = end - port;
+    if (length % width != 0)
+    {
+        fprintf(stderr, "port range is not a multiple of %u\n", width);
+        return -1;
+    }
+    if (filename)
+    {
+        out = fopen(filename, "wb");
+        if (!out)
+        {
+            perror(filename);
+            return -1;
+        }
+    }
+    for (i = 0; i < length; i += width)
+    {
+        parsed_io_address = port + i;
+        value = read_item(&iospace, width);
+        if (out)
+        {
+            for (byte = 0; byte < width; byte++)
+                putc((unsigned char)(value >> (8 * byte)), out);
+            continue;
+        }
+        if (i % 16 == 0)
+            printf("%04x:", port + i);
+        printf(" %0*lx", (int)(2 * width), value);
+        if (i % 16 == 16 - width || i + width == length)
+            putchar('\n');
+    }
+    if (out && (ferror(out) || fclose(out) != 0))
+    {
+        fputs("write error\n", stderr);
+        return -1;
+    }
+    return 0;
+}
+
+// PIT channel 2 runs in mode 2 with a count of 65536 while waiting, with
+// the speaker output turned off. Unlike channel 0, whose rate DOS or a TSR
+// may have changed, it doesn't have to be put back afterwards, as the BIOS
+// programs it for every beep. Wraps of its counter are counted by
+// pit_time, which has to be called at least every 55ms.
+static unsigned char old_port61;
+static unsigned last_clocks;
+static unsigned long wrapped_clocks;
+
+void pit_start(void)
+{
+    _disable();
+    old_port61 = inp(0x61);
+    outp(0x61, (old_port61 & ~2) | 1);  // gate on, speaker off
+    outp(0x43, 0xB4);
+    outp(0x42, 0);
+    outp(0x42, 0);
+    _enable();
+    last_clocks = 0;
+    wrapped_clocks = 0;
+}
+
+void pit_stop(void)
+{
+    outp(0x61, old_port61);
+}
+
+// Time in PIT clocks of 1/1193182 seconds, wrapping after an hour
+unsigned long pit_time(void)
+{
+    unsigned count, clocks;
+    _disable();
+    outp(0x43, 0x80);                   // latch channel 2
+    count = inp(0x42);
+    count |= inp(0x42) << 8;
+    _enable();
+    clocks = (unsigned)((0x10000UL - count) & 0xFFFF);
+    if (clocks < last_clocks)
+        wrapped_clocks += 0x10000UL;
+    last_clocks = clocks;
+    return wrapped_clocks + clocks;
+}
+
+unsigned long pit_to_us(unsigned long clocks)
+{
+    return clocks / 1193 * 1000 + clocks % 1193 * 1000 / 1193;
+}
+
+// wait verbs: <mask> <value> <timeout_ms>. Polls until the bits in mask
+// have the given value. The time is checked every TIME_CHECK polls only,
+// but taken right after the poll that succeeds. Returns 1 on timeout. The
+// longest timeout stays well below the wrap of pit_time.
+#define TIME_CHECK 16
+#define MAX_TIMEOUT 3000000UL
+int wait_for(const space_t* space, unsigned width, int argc, char** argv)
+{
+    char dummy;
+    unsigned long mask, expected, timeout, value;
+    unsigned long start, now;
+    unsigned long polls = 0;
+    unsigned long limit = width == 4 ? 0xFFFFFFFFUL : (1UL << (8 * width)) - 1;
+    if (argc < 3)
+    {
+        fputs("missing mask, value or timeout\n", stderr);
+        return -1;
+    }
+    if (sscanf(argv[0], "%lx%c", &mask, &dummy) != 1 || mask > limit ||
+        sscanf(argv[1], "%lx%c", &expected, &dummy) != 1 || expected > limit)
+    {
+        fputs("Bad mask or value\n", stderr);
+        return -1;
+    }
+    if (expected & ~mask)
+    {
+        fputs("value has bits set that are not in the mask\n", stderr);
+        return -1;
+    }
+    if (sscanf(argv[2], "%lu%c", &timeout, &dummy) != 1 || timeout > MAX_TIMEOUT)
+    {
+        fprintf(stderr, "Bad timeout, must be 0..%lu ms\n", MAX_TIMEOUT);
+        return -1;
+    }
+    timeout *= 1193;
+    pit_start();
+    start = pit_time();
+    for (;;)
+    {
+        value = read_item(space, width);
+        polls++;
+        if ((value & mask) == expected)
+        {
+            now = pit_time();
+            break;
+        }
+        if (polls % TIME_CHECK == 0)
+        {
+            now = pit_time();
+            if (now - start > timeout)
+                break;
+        }
+    }
+    pit_stop();
+    if ((value & mask) != expected)
+    {
+        printf("timeout after %lu us, %lu polls, last value %0*lx\n",
+               pit_to_us(now - start), polls, (int)(2 * width), value);
+        return 1;
+    }
+    printf("%0*lx after %lu us, %lu polls\n", (int)(2 * width), value, pit_to_us(now - start), polls);
+    return 0;
+}
+
 int main(int argc, char** argv)
 {
     char dummy;
     char sizechar;
     unsigned long value;
-    enum { MODE_POKE, MODE_PEEK } mode;
+    long count;
+    unsigned index, last;
+    int status;
+    enum { MODE_POKE, MODE_PEEK, MODE_INS, MODE_OUTS, MODE_DUMP, MODE_INDEXED, MODE_WAIT } mode;
     const space_t* space;
 
     if (argc < 2)
@@ -165,7 +800,49 @@ int main(int argc, char** argv)
         return 1;
     }
 
-    if (strncmp(argv[1], "out", 3) == 0)
+    if (strcmp(argv[1], "idxin") == 0 || strcmp(argv[1], "idxout") == 0)
+    {
+        sizechar = 'b';
+        space = &idxspace;
+        mode = MODE_INDEXED;
+    }
+    else if (strcmp(argv[1], "idxwait") == 0)
+    {
+        sizechar = 'b';
+        space = &idxspace;
+        mode = MODE_WAIT;
+    }
+    else if (strncmp(argv[1], "mwait", 5) == 0)
+    {
+        sizechar = argv[1][5];
+        space = &memspace;
+        mode = MODE_WAIT;
+    }
+    else if (strncmp(argv[1], "wait", 4) == 0)
+    {
+        sizechar = argv[1][4];
+        space = &iospace;
+        mode = MODE_WAIT;
+    }
+    else if (strncmp(argv[1], "outs", 4) == 0)
+    {
+        sizechar = argv[1][4];
+        space = &iospace;
+        mode = MODE_OUTS;
+    }
+    else if (strncmp(argv[1], "dump", 4) == 0)
+    {
+        sizechar = argv[1][4];
+        space = &iospace;
+        mode = MODE_DUMP;
+    }
+    else if (strncmp(argv[1], "ins", 3) == 0)
+    {
+        sizechar = argv[1][3];
+        space = &iospace;
+        mode = MODE_INS;
+    }
+    else if (strncmp(argv[1], "out", 3) == 0)
     {
         sizechar = argv[1][3];
         space = &iospace;
@@ -177,12 +854,18 @@ int main(int argc, char** argv)
         space = &iospace;
         mode = MODE_PEEK;
     }
-/*    else if (strncmp(argv[1], "poke", 4) == 0)
+    else if (strncmp(argv[1], "poke", 4) == 0)
     {
         sizechar = argv[1][4];
-        space = memspace;
+        space = &memspace;
         mode = MODE_POKE;
-    }*/
+    }
+    else if (strncmp(argv[1], "peek", 4) == 0)
+    {
+        sizechar = argv[1][4];
+        space = &memspace;
+        mode = MODE_PEEK;
+    }
     else
     {
         fputs("Bad verb\n", stderr);
@@ -195,13 +878,85 @@ int main(int argc, char** argv)
         return 1;
     }
 
+    if (mode == MODE_DUMP)
+    {
+        if (size_width(sizechar) == 0)
+        {
+            fputs("Bad size character\n", stderr);
+            return 1;
+        }
+        return dump_ports(argc - 2, argv + 2, size_width(sizechar)) < 0 ? 1 : 0;
+    }
+
     if (space->parse_address(argv[2]) < 0)
     {
         fputs("Bad address\n", stderr);
         return 1;
     }
+    if (space == &memspace && size_width(sizechar) != 0 && !mem_access_possible(size_width(sizechar)))
+        return 1;
 
-    if (mode == MODE_POKE)
+    if (mode == MODE_WAIT)
+    {
+        if (size_width(sizechar) == 0)
+        {
+            fputs("Bad size character\n", stderr);
+            return 1;
+        }
+        if (space == &idxspace)
+        {
+            if (argc < 4 || parse_index_range(argv[3], &index, &last) < 0 || index != last)
+            {
+                fputs("Bad index, must be ii\n", stderr);
+                return 1;
+            }
+            parsed_index = index;
+            argc--;
+            argv++;
+        }
+        status = wait_for(space, size_width(sizechar), argc - 3, argv + 3);
+        return status < 0 ? 1 : status > 0 ? 2 : 0;
+    }
+    else if (mode == MODE_INDEXED)
+    {
+        return indexed_access(space, argv[1][3] == 'o', argc - 3, argv + 3) < 0 ? 1 : 0;
+    }
+    else if (mode == MODE_INS || mode == MODE_OUTS)
+    {
+        if (size_width(sizechar) == 0)
+        {
+            fputs("Bad size character\n", stderr);
+            return 1;
+        }
+        if (size_width(sizechar) == 4 && cpu_level() < 3)
+        {
+            fputs("dword transfers need a 386 or newer\n", stderr);
+            return 1;
+        }
+        if (mode == MODE_OUTS)
+        {
+            if (argc < 4)
+            {
+                fputs("missing file name\n", stderr);
+                return 1;
+            }
+            return write_from_file(space, size_width(sizechar), argv[3]) < 0 ? 1 : 0;
+        }
+        if (argc < 5)
+        {
+            fputs("missing count or file name\n", stderr);
+            return 1;
+        }
+        // a count that doesn't fit into a long can't fit into a file either
+        if (sscanf(argv[3], "%li%c", &count, &dummy) != 1 || count <= 0 ||
+            count > 0x7FFFFFFFL / size_width(sizechar))
+        {
+            fprintf(stderr, "Bad count, must be 1..%ld\n", 0x7FFFFFFFL / size_width(sizechar));
+            return 1;
+        }
+        return read_to_file(space, size_width(sizechar), count, argv[4]) < 0 ? 1 : 0;
+    }
+    else if (mode == MODE_POKE)
     {
         if (argc < 4)
         {
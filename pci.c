@@ -1,13 +1,11 @@
+#include <ctype.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "pci.h"
 
 #define ARRAYSIZE(x) (sizeof(x) / sizeof(x[0]))
 
-#define CMD_IO 1
-#define CMD_MEM 2
-#define CMD_MASTER 4
-
 char *format_addr(dev_addr addr)
 {
     static char addrbuf[20];
@@ -15,36 +13,23 @@ char *format_addr(dev_addr addr)
     return addrbuf;
 }
 
-int read_barsize(dev_addr addr, unsigned int bar, unsigned long oldbar, unsigned int cmdbit, unsigned long *barsize)
+// Turns what a BAR reads back after writing all ones into the size of the
+// decoded range.
+unsigned long bar_size(unsigned long probe, int is_io)
 {
-    unsigned int oldcmd;
-    unsigned long localsize;
-    int status;
-    if (pci_read_word(addr, 4, &oldcmd) < 0)
-       return -1;
-    if (pci_write_word(addr, 4, oldcmd & ~cmdbit) < 0)
-       return -1;
-    status = pci_write_dword(addr, bar, 0xFFFFFFFFUL);
-    status |= pci_read_dword(addr, bar, &localsize);
-    status |= pci_write_dword(addr, bar, oldbar);
-    status |= pci_write_word(addr, 4, oldcmd);
-
-    if (cmdbit == CMD_MEM)
+    if (is_io)
     {
-        // clear memory type flags
-        localsize &= ~0xFUL;
+        // clear IO bit and reserved extra bit
+        probe &= ~3UL;
+        // fake top bits as writeable even for devices that only accept 16 bit I/O addresses
+        probe |= 0xFFFF0000UL;
     }
     else
     {
-        // clear IO bit and reserved extra bit
-        localsize &= ~3UL;
-        // fake top bits as writeable even for devices that only accept 16 bit I/O addresses
-        localsize |= 0xFFFF0000UL;
+        // clear memory type flags
+        probe &= ~0xFUL;
     }
-    
-    *barsize = -localsize;
-
-    return status;
+    return -probe & 0xFFFFFFFFUL;
 }
 
 int cmdline_verbose = 1;
@@ -61,114 +46,113 @@ char *nice_size(unsigned long size)
     return sizebuf;
 }
 
-int dump_bar(dev_addr addr, unsigned int bar)
+int dump_bar(const bar_record_t *bars, unsigned int bar)
 {
-    unsigned long barval;
-    unsigned long barval_high;
+    unsigned int idx = (bar - 0x10) / 4;
+    unsigned long barval = bars->value[idx];
     unsigned long barsize;
-    unsigned long barsize_high;
     int bar_width;
 
     bar_width = 4;  // typical BARs are 32 bits (4 bytes) wide
-    if (pci_read_dword(addr, bar, &barval) >= 0)
+    // "unimplemented BARs are hardwired to zero", so they read back 0 after
+    // writing all ones. This is also what is recorded if sizing failed.
+    if (bars->probe[idx] == 0)
+        return bar_width;
+    if (barval & 1)
     {
-        if (barval & 1)
-        {
-            if (read_barsize(addr, bar, barval, CMD_IO, &barsize) >= 0)
-            {
-                barval &= ~3L;
-                printf("  %02x: PIO  at %04lx..%04lx\n", bar, barval, barval + barsize - 1);
-            }
-        }
-        else
+        barsize = bar_size(bars->probe[idx], 1);
+        barval &= ~3L;
+        printf("  %02x: PIO  at %04lx..%04lx\n", bar, barval, barval + barsize - 1);
+    }
+    else
+    {
+        unsigned char barflags;
+        const char *memkind;
+
+        barflags =  barval & 0xF;
+        memkind = (barflags & 8) ? "MEM " : "MMIO";
+        barsize = bar_size(bars->probe[idx], 0);
+        barval &= ~0x0FL;
+        switch(barflags & 0x6)
         {
-            unsigned char barflags;
-            const char *memkind;
-
-            barflags =  barval & 0xF;
-            memkind = (barflags & 8) ? "MEM " : "MMIO";
-            if (read_barsize(addr, bar, barval, CMD_MEM, &barsize) >= 0 &&
-                // "unimplemented BARs are hardwired to zero"
-                // read_barsize returns 0 if a BAR is unimplemented, or if the alignment
-                // requirement is 4G or higher (64-bit BARs). To differentiate, also look
-                // at barflags, which is non-zero on 64-bit BARs.
-                (barflags != 0 || barsize != 0))
+        case 0:
+            // normal 32-bit memory space
+            printf("  %02x: %s at %08lx..%08lx (%s)\n",
+                bar, memkind, barval, (barval + barsize - 1),
+                nice_size(barsize));
+            break;
+        case 2:
+            // Old PCI cards: 1MB memory space
+            printf("  %02x: %s at %05lx..%05lx (%s)\n",
+                bar, memkind, barval, (barval + barsize - 1),
+                nice_size(barsize));
+            break;
+        case 4:
+            // 64-bit memory space
+            if (idx < 5)
             {
-                barval &= ~0x0FL;
-                switch(barflags & 0x6)
-                {
-                case 0:
-                    // normal 32-bit memory space
-                    printf("  %02x: %s at %08lx..%08lx (%s)\n",
-                        bar, memkind, barval, (barval + barsize - 1),
-                        nice_size(barsize));
-                    break;
-                case 2:
-                    // Old PCI cards: 1MB memory space
-                    printf("  %02x: %s at %05lx..%05lx (%s)\n",
-                        bar, memkind, barval, (barval + barsize - 1),
+                // The high dword needs no flag masking, and a low size of 0
+                // means the size is a multiple of 4G.
+                unsigned long barval_high = bars->value[idx + 1];
+                unsigned long barsize_high = ~bars->probe[idx + 1] & 0xFFFFFFFFUL;
+                unsigned long end, end_high;
+                if (barsize == 0)
+                    barsize_high = (barsize_high + 1) & 0xFFFFFFFFUL;
+                end = (barval + barsize - 1) & 0xFFFFFFFFUL;
+                end_high = barval_high + barsize_high - (barsize == 0) + (end < barval);
+                if (barsize_high == 0)
+                    printf("  %02x: %s at %08lx%08lx..%08lx%08lx (%s)\n",
+                        bar, memkind, barval_high, barval, end_high & 0xFFFFFFFFUL, end,
                         nice_size(barsize));
-                    break;
-                case 4:
-                    // 64-bit memory space
-                    if (pci_read_dword(addr, bar + 4, &barval_high) >= 0 &&
-                        read_barsize(addr, bar + 4, barval_high, CMD_MEM, &barsize_high) >= 0)
-                    {
-                        if (barsize == 0)  // this actually means 4G
-                            barsize_high++;
-                        printf("  %02x: %s at %08lx%08lx..%08lx%08lx (%s)\n",
-                            bar, memkind, barval_high, barval, (barval_high + barsize_high), (barval + barsize - 1),
-                            nice_size(barsize));
-                    }
-                    bar_width = 8;
-                    break;
-                default:
-                    printf("  %02x: unhandled memory BAR type\n");
-                    break;
-                }
+                else
+                    printf("  %02x: %s at %08lx%08lx..%08lx%08lx (%luG)\n",
+                        bar, memkind, barval_high, barval, end_high & 0xFFFFFFFFUL, end,
+                        barsize_high * 4 + (barsize >> 30));
+                bar_width = 8;
+                break;
             }
+            // fall through
+        default:
+            printf("  %02x: unhandled memory BAR type\n", bar);
+            break;
         }
     }
     return bar_width;
 }
 
-void dump_rombar(dev_addr addr, unsigned bar)
+void dump_rombar(const bar_record_t *bars)
 {
-    unsigned long barval;
-    if (pci_read_dword(addr, bar, &barval) >= 0)
+    unsigned long barval = bars->value[PROBE_ROM];
+    if (barval & 1)
     {
-        if (barval & 1)
-        {
-            printf("  ROM enabled at %08lx\n", barval & ~1UL);
-        }
-        else
-        {
-            unsigned long barsize;
-            if (read_barsize(addr, bar, barval, CMD_MEM, &barsize) >= 0 &&
-                barsize != 0)
-                printf("  ROM (disabled), area size %08lx (%s)\n", barsize, nice_size(barsize));
-        }
+        printf("  ROM enabled at %08lx\n", barval & ~1UL);
+    }
+    else
+    {
+        unsigned long barsize = bar_size(bars->probe[PROBE_ROM], 0);
+        if (barsize != 0)
+            printf("  ROM (disabled), area size %08lx (%s)\n", barsize, nice_size(barsize));
     }
 }
 
-void dump_resources(dev_addr addr)
+void dump_resources(const bar_record_t *bars)
 {
     unsigned int bar;
-    for (bar = 0x10; bar <= 0x20;)
+    for (bar = 0x10; bar <= 0x24;)
     {
-        bar += dump_bar(addr, bar);
+        bar += dump_bar(bars, bar);
     }
-    dump_rombar(addr, 0x30);
+    dump_rombar(bars);
 }
 
-void dump_bridge(dev_addr addr)
+void dump_bridge(dev_addr addr, const bar_record_t *bars)
 {
     unsigned char primary_bus, secondary_bus, limit_bus;
     unsigned int memlow, memhigh;
     unsigned int bar;
-    for (bar = 0x10; bar <= 0x14; bar += 4)
+    for (bar = 0x10; bar <= 0x14;)
     {
-        dump_bar(addr, bar);
+        bar += dump_bar(bars, bar);
     }
     if (pci_read_byte(addr, 0x18, &primary_bus) >= 0 &&
         pci_read_byte(addr, 0x19, &secondary_bus) >= 0 &&
@@ -229,6 +213,9 @@ void dump_device(dev_addr addr)
     unsigned char cls, subcls, progif;
     unsigned char intpin, irqnum;
     unsigned char hdrtype;
+    bar_record_t bars;
+    // all registers of this function are read at most once
+    pci_cache_open(addr, 0x40);
     if (pci_read_byte(addr, 0xE, &hdrtype) >= 0 &&
         pci_read_word(addr, 0, &vendor) >= 0 &&
         pci_read_word(addr, 2, &device) >= 0 &&
@@ -242,10 +229,14 @@ void dump_device(dev_addr addr)
                cls, subcls, progif);
         if (cmdline_verbose)
         {
+            // one sizing pass for all BARs, so decoding is off only once
+            hdrtype &= 0x7F;
+            if ((hdrtype == 0 || hdrtype == 1) && pci_probe_bars(addr, &bars) < 0)
+                memset(&bars, 0, sizeof bars);
             if (hdrtype == 0)
-                dump_resources(addr);
+                dump_resources(&bars);
             if (hdrtype == 1)
-                dump_bridge(addr);
+                dump_bridge(addr, &bars);
             if (pci_read_byte(addr, 0x3D, &intpin) >= 0 &&
                 intpin != 0 &&
                 pci_read_byte(addr, 0x3C, &irqnum) >= 0)
@@ -256,28 +247,52 @@ void dump_device(dev_addr addr)
     }
     else
         printf("%s: <error>\n", format_addr(addr));
+    pci_cache_close();
+}
+
+void capture_device(dev_addr addr)
+{
+    if (pci_image_add(addr) < 0)
+        printf("%s: <error>\n", format_addr(addr));
+    else if (cmdline_verbose > 1)
+        printf("%s: saved\n", format_addr(addr));
 }
 
 typedef void iterate_fn(dev_addr addr);
+typedef void iterator_fn(iterate_fn *handler);
 
-void iterate_class(unsigned long classcode, iterate_fn *handler)
-{
-    int idx;
+// All functions found by one bus scan, in bus order. This answers device
+// ID and class searches without calling the PCI BIOS again.
+struct device_info {
     dev_addr addr;
-    for (idx = 0; dev_by_class(classcode, idx, &addr) >= 0; idx++)
-    {
-        handler(addr);
-    }
-}
+    unsigned vendor, device;
+    unsigned long classcode;
+    unsigned char hdrtype;
+};
 
-void iterate_devid(unsigned int vendor, unsigned int device, iterate_fn *handler)
+#define MAX_DEVICES 256
+struct device_info devices[MAX_DEVICES];
+int device_count = -1;  // not scanned yet
+
+void add_device(dev_addr addr)
 {
-    int idx;
-    dev_addr addr;
-    for (idx = 0; dev_by_id(vendor, device, idx, &addr) >= 0; idx++)
+    struct device_info *d;
+    unsigned long id, classrev;
+    if (device_count == MAX_DEVICES)
     {
-        handler(addr);
+        fprintf(stderr, "too many functions, ignoring %s\n", format_addr(addr));
+        return;
     }
+    d = &devices[device_count];
+    if (pci_read_dword(addr, 0, &id) < 0 ||
+        pci_read_dword(addr, 8, &classrev) < 0 ||
+        pci_read_byte(addr, 0xE, &d->hdrtype) < 0)
+        return;
+    d->addr = addr;
+    d->vendor = (unsigned)(id & 0xFFFF);
+    d->device = (unsigned)(id >> 16);
+    d->classcode = classrev >> 8;
+    device_count++;
 }
 
 void iterate_all(iterate_fn *handler)
@@ -289,7 +304,9 @@ void iterate_all(iterate_fn *handler)
         {
             dev_addr addr = ADDR(bus, dev, 0);
             unsigned char hdrtype;
+            pci_cache_open(addr, 0x10);
             pci_read_byte(addr, 0xE, &hdrtype);
+            pci_cache_close();
             if (hdrtype != 0xff)
             {
                 int maxfncount = 1;
@@ -297,10 +314,12 @@ void iterate_all(iterate_fn *handler)
                     maxfncount = 8;
                 for (fn = 0; fn < maxfncount; fn++)
                 {
+                    pci_cache_open(addr + fn, 0x10);
                     pci_read_byte(addr + fn, 0xE, &hdrtype);
                     if (hdrtype != 0xff)
                         handler(addr + fn);
-                    else
+                    pci_cache_close();
+                    if (hdrtype == 0xff)
                         break;
                 }
             }
@@ -308,27 +327,347 @@ void iterate_all(iterate_fn *handler)
     }
 }
 
-unsigned long cmdline_class;
+// Only scans busses that are reachable through bridges, starting at bus 0.
+// Bus numbers are assigned depth-first, so a secondary bus is always higher
+// than the bus its bridge is on, and one pass over the bus numbers suffices.
+void iterate_tree(iterate_fn *handler)
+{
+    unsigned char pending[256 / 8];
+    int bus, dev, fn;
+    memset(pending, 0, sizeof pending);
+    pending[0] = 1;
+    for (bus = 0; bus < 256; bus++)
+    {
+        if (!(pending[bus >> 3] & (1 << (bus & 7))))
+            continue;
+        for (dev = 0; dev < 32; dev++)
+        {
+            int maxfncount = 1;
+            for (fn = 0; fn < maxfncount; fn++)
+            {
+                dev_addr addr = ADDR(bus, dev, fn);
+                unsigned long id;
+                unsigned char hdrtype, secondary;
+                pci_cache_open(addr, 0x10);
+                if (pci_read_dword(addr, 0, &id) < 0 ||
+                    (id & 0xFFFF) == 0xFFFF ||
+                    pci_read_byte(addr, 0xE, &hdrtype) < 0)
+                {
+                    pci_cache_close();
+                    continue;
+                }
+                if (fn == 0 && (hdrtype & 0x80))
+                    maxfncount = 8;
+                // PCI-to-PCI and CardBus bridges
+                if (((hdrtype & 0x7F) == 1 || (hdrtype & 0x7F) == 2) &&
+                    pci_read_byte(addr, 0x19, &secondary) >= 0 &&
+                    secondary > bus)
+                {
+                    pending[secondary >> 3] |= 1 << (secondary & 7);
+                }
+                handler(addr);
+                pci_cache_close();
+            }
+        }
+    }
+}
+
+iterator_fn *scan_devices = iterate_tree;
+
+// The device table is kept in a file across invocations. It is reused if
+// the BIOS version, last_bus, the scan mode and the IDs on bus 0 still
+// match, which takes 32 configuration reads instead of a full scan.
+//
+// File format, all numbers little endian:
+//   key:     "PCIENUM\0", version (1 byte), scan mode (1 byte), last_bus (1 byte),
+//            BIOS version (2 bytes), bus 0 fingerprint (4 bytes)
+//   count:   number of records (2 bytes)
+//   records: address (2 bytes), vendor (2 bytes), device (2 bytes),
+//            class code (3 bytes), header type (1 byte)
+#define ENUM_MAGIC "PCIENUM"
+#define ENUM_VERSION 1
+#define ENUM_KEY_SIZE 17
+#define ENUM_RECORD_SIZE 10
+#ifdef __linux__
+#define PATH_SEPARATOR '/'
+#else
+#define PATH_SEPARATOR '\\'
+#endif
+
+char enum_cache_name[80];   // empty if the cache is not used
+int enum_rescan = 0;
+int table_from_cache = 0;
+
+void enum_cache_init(void)
+{
+    const char *dir = getenv("TEMP");
+    size_t len;
+    if (!dir)
+        dir = getenv("TMP");
+    if (!dir || (len = strlen(dir)) + sizeof "\\PCIENUM.DAT" > sizeof enum_cache_name)
+        return;
+    strcpy(enum_cache_name, dir);
+    if (len > 0 && dir[len - 1] != '/' && dir[len - 1] != '\\')
+        enum_cache_name[len++] = PATH_SEPARATOR;
+    strcpy(enum_cache_name + len, "PCIENUM.DAT");
+}
+
+// Combines the IDs of the primary functions on bus 0, either read from the
+// hardware or, after a scan, taken from the device table.
+unsigned long bus0_fingerprint(int from_table)
+{
+    unsigned long sum = 0, id;
+    unsigned dev;
+    int idx;
+    for (dev = 0; dev < 32; dev++)
+    {
+        id = 0xFFFFFFFFUL;
+        if (!from_table)
+            pci_read_dword(ADDR(0, dev, 0), 0, &id);
+        for (idx = 0; from_table && idx < device_count; idx++)
+        {
+            if (devices[idx].addr == ADDR(0, dev, 0))
+                id = ((unsigned long)devices[idx].device << 16) | devices[idx].vendor;
+        }
+        sum = (((sum << 5) | (sum >> 27)) ^ id) & 0xFFFFFFFFUL;
+    }
+    return sum;
+}
+
+void make_enum_key(unsigned char *key, unsigned long fingerprint)
+{
+    memcpy(key, ENUM_MAGIC, 8);
+    key[8] = ENUM_VERSION;
+    key[9] = scan_devices == iterate_all;
+    key[10] = last_bus;
+    key[11] = (unsigned char)bios_version;
+    key[12] = (unsigned char)(bios_version >> 8);
+    key[13] = (unsigned char)fingerprint;
+    key[14] = (unsigned char)(fingerprint >> 8);
+    key[15] = (unsigned char)(fingerprint >> 16);
+    key[16] = (unsigned char)(fingerprint >> 24);
+}
+
+int load_device_table(const unsigned char *key)
+{
+    unsigned char header[ENUM_KEY_SIZE + 2];
+    unsigned char record[ENUM_RECORD_SIZE];
+    int count, idx;
+    FILE *f = fopen(enum_cache_name, "rb");
+    if (!f)
+        return -1;
+    if (fread(header, 1, sizeof header, f) != sizeof header ||
+        memcmp(header, key, ENUM_KEY_SIZE) != 0 ||
+        (count = header[ENUM_KEY_SIZE] | (header[ENUM_KEY_SIZE + 1] << 8)) > MAX_DEVICES)
+    {
+        fclose(f);
+        return -1;
+    }
+    for (idx = 0; idx < count; idx++)
+    {
+        struct device_info *d = &devices[idx];
+        if (fread(record, 1, sizeof record, f) != sizeof record)
+        {
+            fclose(f);
+            return -1;
+        }
+        d->addr = record[0] | (record[1] << 8);
+        d->vendor = record[2] | (record[3] << 8);
+        d->device = record[4] | (record[5] << 8);
+        d->classcode = record[6] | ((unsigned)record[7] << 8) | ((unsigned long)record[8] << 16);
+        d->hdrtype = record[9];
+    }
+    fclose(f);
+    device_count = count;
+    return 0;
+}
+
+void save_device_table(const unsigned char *key)
+{
+    unsigned char record[ENUM_RECORD_SIZE];
+    int idx;
+    int status = 0;
+    FILE *f = fopen(enum_cache_name, "wb");
+    if (!f)
+        return;
+    record[0] = (unsigned char)device_count;
+    record[1] = (unsigned char)(device_count >> 8);
+    if (fwrite(key, 1, ENUM_KEY_SIZE, f) != ENUM_KEY_SIZE ||
+        fwrite(record, 1, 2, f) != 2)
+        status = -1;
+    for (idx = 0; idx < device_count && status == 0; idx++)
+    {
+        const struct device_info *d = &devices[idx];
+        record[0] = (unsigned char)d->addr;
+        record[1] = (unsigned char)(d->addr >> 8);
+        record[2] = (unsigned char)d->vendor;
+        record[3] = (unsigned char)(d->vendor >> 8);
+        record[4] = (unsigned char)d->device;
+        record[5] = (unsigned char)(d->device >> 8);
+        record[6] = (unsigned char)d->classcode;
+        record[7] = (unsigned char)(d->classcode >> 8);
+        record[8] = (unsigned char)(d->classcode >> 16);
+        record[9] = d->hdrtype;
+        if (fwrite(record, 1, sizeof record, f) != sizeof record)
+            status = -1;
+    }
+    if (fclose(f) != 0 || status < 0)
+        remove(enum_cache_name);   // a truncated table would be rejected anyway
+}
 
-void iterate_cmdline_class(iterate_fn *handler)
+// Called when bus numbers might have changed, so the next run rescans.
+void forget_device_table(void)
 {
-    iterate_class(cmdline_class, handler);
+    if (enum_cache_name[0])
+        remove(enum_cache_name);
 }
 
-unsigned int cmdline_vendor, cmdline_device;
+void scan_once(void)
+{
+    unsigned char key[ENUM_KEY_SIZE];
+    if (device_count >= 0)
+        return;
+    if (enum_cache_name[0] && !enum_rescan)
+    {
+        make_enum_key(key, bus0_fingerprint(0));
+        if (load_device_table(key) == 0)
+        {
+            if (cmdline_verbose > 1)
+                printf("Device table read from %s\n", enum_cache_name);
+            table_from_cache = 1;
+            return;
+        }
+    }
+    table_from_cache = 0;
+    device_count = 0;
+    scan_devices(add_device);
+    if (enum_cache_name[0])
+    {
+        make_enum_key(key, bus0_fingerprint(1));
+        save_device_table(key);
+    }
+}
 
-void iterate_cmdline_devid(iterate_fn *handler)
+// The bus 0 fingerprint doesn't cover cards behind bridges, so every entry
+// from the cache file that a search hits is checked against the hardware:
+// reg 0 for the IDs, reg 8 for the class code.
+int entry_outdated(const struct device_info *d, unsigned int reg)
 {
-    iterate_devid(cmdline_vendor, cmdline_device, handler);
+    unsigned long value, expected;
+    if (!table_from_cache)
+        return 0;
+    if (pci_read_dword(d->addr, reg, &value) < 0)
+        return 1;
+    if (reg == 0)
+        expected = ((unsigned long)d->device << 16) | d->vendor;
+    else
+    {
+        expected = d->classcode;
+        value >>= 8;
+    }
+    return value != expected;
 }
 
-dev_addr cmdline_addr;
+void rescan(void)
+{
+    if (cmdline_verbose > 1)
+        printf("%s is outdated, rescanning\n", enum_cache_name);
+    device_count = -1;
+    enum_rescan = 1;
+    scan_once();
+}
 
-void iterate_cmdline_addr(iterate_fn *handler)
+void iterate_devices(iterate_fn *handler)
 {
-    handler(cmdline_addr);
+    int idx;
+    scan_once();
+    for (idx = 0; idx < device_count; idx++)
+    {
+        handler(devices[idx].addr);
+    }
+}
+
+int find_by_id(unsigned int vendor, unsigned int device, int index, dev_addr *addr)
+{
+    int idx;
+    int n = index;
+    scan_once();
+    for (idx = 0; idx < device_count; idx++)
+    {
+        if (devices[idx].vendor == vendor && devices[idx].device == device &&
+            n-- == 0)
+        {
+            if (entry_outdated(&devices[idx], 0))
+            {
+                rescan();
+                return find_by_id(vendor, device, index, addr);
+            }
+            *addr = devices[idx].addr;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int find_by_class(unsigned long classcode, int index, dev_addr *addr)
+{
+    int idx;
+    int n = index;
+    scan_once();
+    for (idx = 0; idx < device_count; idx++)
+    {
+        if (devices[idx].classcode == classcode && n-- == 0)
+        {
+            if (entry_outdated(&devices[idx], 8))
+            {
+                rescan();
+                return find_by_class(classcode, index, addr);
+            }
+            *addr = devices[idx].addr;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void iterate_class(unsigned long classcode, iterate_fn *handler)
+{
+    int idx;
+    scan_once();
+    for (idx = 0; idx < device_count; idx++)
+    {
+        if (devices[idx].classcode == classcode && entry_outdated(&devices[idx], 8))
+        {
+            rescan();
+            break;
+        }
+    }
+    for (idx = 0; idx < device_count; idx++)
+    {
+        if (devices[idx].classcode == classcode)
+            handler(devices[idx].addr);
+    }
+}
+
+void iterate_devid(unsigned int vendor, unsigned int device, iterate_fn *handler)
+{
+    int idx;
+    scan_once();
+    for (idx = 0; idx < device_count; idx++)
+    {
+        if (devices[idx].vendor == vendor && devices[idx].device == device &&
+            entry_outdated(&devices[idx], 0))
+        {
+            rescan();
+            break;
+        }
+    }
+    for (idx = 0; idx < device_count; idx++)
+    {
+        if (devices[idx].vendor == vendor && devices[idx].device == device)
+            handler(devices[idx].addr);
+    }
 }
-typedef void iterator_fn(iterate_fn *handler);
 
 #define NOP         0
 #define READ_BYTE   1
@@ -342,392 +681,888 @@ typedef void iterator_fn(iterate_fn *handler);
 #define PATCH_DWORD 9
 
 struct patch_info {
-       unsigned char regnr;
+       unsigned int regnr;
        unsigned char mode;
        unsigned long xormask;
        unsigned long andmask;
 };
 
-// Under DOS, we have 128 bytes command line, so we can't reach 40 reads
-struct patch_info cmdline_patches[40] = {0};
+struct patch_group;
+struct pending_print;
+
+// A device specification and the patchspecs to apply to the selected
+// devices. The command line describes a single job, a script any number.
+struct job {
+       const char *spec;
+       iterator_fn *iter;
+       unsigned long classcode;
+       unsigned int vendor, device;
+       int instance;
+       dev_addr addr;
+       struct patch_info *patches;
+       int patch_count;
+       struct patch_group *groups;
+       int group_count;
+       struct pending_print *pending;
+};
+
+const struct job *current_job;
+int exit_status = 0;
+
+void iterate_job_class(iterate_fn *handler)
+{
+    iterate_class(current_job->classcode, handler);
+}
+
+void iterate_job_devid(iterate_fn *handler)
+{
+    iterate_devid(current_job->vendor, current_job->device, handler);
+}
+
+void iterate_job_addr(iterate_fn *handler)
+{
+    handler(current_job->addr);
+}
+
+void iterate_job_class_instance(iterate_fn *handler)
+{
+    dev_addr addr;
+    if (find_by_class(current_job->classcode, current_job->instance, &addr) < 0)
+    {
+        fprintf(stderr, "device %s not found\n", current_job->spec);
+        exit_status = 1;
+        return;
+    }
+    handler(addr);
+}
+
+void iterate_job_devid_instance(iterate_fn *handler)
+{
+    dev_addr addr;
+    if (find_by_id(current_job->vendor, current_job->device, current_job->instance, &addr) < 0)
+    {
+        fprintf(stderr, "device %s not found\n", current_job->spec);
+        exit_status = 1;
+        return;
+    }
+    handler(addr);
+}
+
+// Patchspecs are compiled into groups of consecutive patchspecs on the same
+// dword that modify different bytes. A patchspec that modifies a byte again
+// starts a new group, so every write reaches the hardware in the given order
+// (e.g. toggling a bit, or an index/data pair) and a read-modify-write sees
+// what the hardware returns after the earlier write. A group reads its dword
+// at most once (again only if a read follows a write), collects all
+// modifications in memory and writes them back at the end, using as few
+// accesses as possible that cover just the modified bytes.
+// Bytes next to the modified ones are never written, as they might be
+// write-one-to-clear status bits.
+struct patch_group {
+       unsigned char reg;      // dword aligned
+       int first;              // index into the patches of the job
+       int count;
+};
+
+struct pending_print {
+    const struct patch_info *p;
+    unsigned long new_val, old_val;
+};
+
+unsigned int patch_size(unsigned char mode)
+{
+    switch (mode)
+    {
+        case READ_BYTE:
+        case WRITE_BYTE:
+        case PATCH_BYTE:
+            return 1;
+        case READ_WORD:
+        case WRITE_WORD:
+        case PATCH_WORD:
+            return 2;
+        default:
+            return 4;
+    }
+}
+
+// bit n set = byte n of the dword is accessed
+unsigned int patch_lanes(const struct patch_info *p)
+{
+    return ((1 << patch_size(p->mode)) - 1) << (p->regnr & 3);
+}
+
+unsigned long lane_mask(unsigned int lanes)
+{
+    unsigned long mask = 0;
+    int i;
+    for (i = 0; i < 4; i++)
+        if (lanes & (1 << i))
+            mask |= 0xFFUL << (8 * i);
+    return mask;
+}
+
+int compile_patches(struct job *j)
+{
+    int idx;
+    unsigned int modified = 0;  // bytes modified by the current group
+    struct patch_group *g = NULL;
+    j->groups = malloc(j->patch_count * sizeof *j->groups);
+    j->pending = malloc(j->patch_count * sizeof *j->pending);
+    if (!j->groups || !j->pending)
+        return -1;
+    j->group_count = 0;
+    for (idx = 0; idx < j->patch_count; idx++)
+    {
+        const struct patch_info *p = &j->patches[idx];
+        if (p->mode == NOP)
+            continue;
+        if (!g || g->reg != (p->regnr & 0xFC) || g->first + g->count != idx ||
+            (modified & patch_lanes(p)))
+        {
+            g = &j->groups[j->group_count++];
+            g->reg = p->regnr & 0xFC;
+            g->first = idx;
+            g->count = 0;
+            modified = 0;
+        }
+        if (p->mode > READ_DWORD)
+            modified |= patch_lanes(p);
+        g->count++;
+    }
+    return 0;
+}
 
-void apply_patch(dev_addr addr, const struct patch_info *p)
+void print_patch(dev_addr addr, const struct patch_info *p, unsigned long new_val, unsigned long old_val)
 {
-    unsigned char b;
-    unsigned int  w;
-    unsigned long d;
     switch(p->mode)
     {
-        case NOP:
-            break;
         case READ_BYTE:
-            if (pci_read_byte(addr, p->regnr, &b) >= 0)
-                printf("%s - %02x is %02x\n",
-                       format_addr(addr), p->regnr, b);
+            printf("%s - %02x is %02x\n",
+                   format_addr(addr), p->regnr, (unsigned char)new_val);
             break;
         case READ_WORD:
-            if (pci_read_word(addr, p->regnr, &w) >= 0)
-                printf("%s - %02x.W is %04x\n",
-                       format_addr(addr), p->regnr, w);
+            printf("%s - %02x.W is %04x\n",
+                   format_addr(addr), p->regnr, (unsigned)new_val);
             break;
         case READ_DWORD:
-            if (pci_read_dword(addr, p->regnr, &d) >= 0)
-                printf("%s - %02x.L is %08lx\n",
-                       format_addr(addr), p->regnr, d);
+            printf("%s - %02x.L is %08lx\n",
+                   format_addr(addr), p->regnr, new_val);
             break;
         case WRITE_BYTE:
-            if (pci_write_byte(addr, p->regnr, (unsigned char)p->xormask) >= 0 && cmdline_verbose)
-                printf("%s - %02x <- %02x\n",
-                       format_addr(addr), p->regnr, (unsigned char)p->xormask);
+            printf("%s - %02x <- %02x\n",
+                   format_addr(addr), p->regnr, (unsigned char)new_val);
             break;
         case WRITE_WORD:
-            if (pci_write_word(addr, p->regnr, (unsigned int)p->xormask) >= 0 && cmdline_verbose)
-                printf("%s - %02x.W <- %04x\n",
-                       format_addr(addr), p->regnr, (unsigned int)p->xormask);
+            printf("%s - %02x.W <- %04x\n",
+                   format_addr(addr), p->regnr, (unsigned)new_val);
             break;
         case WRITE_DWORD:
-            if (pci_write_dword(addr, p->regnr, p->xormask) >= 0 && cmdline_verbose)
-                printf("%s - %02x.L <- %08lx\n",
-                       format_addr(addr), p->regnr, p->xormask);
+            printf("%s - %02x.L <- %08lx\n",
+                   format_addr(addr), p->regnr, new_val);
             break;
         case PATCH_BYTE:
-            if (pci_read_byte(addr, p->regnr, &b) >= 0)
-            {
-                unsigned char new_b = (b & p->andmask) ^ p->xormask;
-                if (pci_write_byte(addr, p->regnr, new_b) >= 0 && cmdline_verbose)
-                    printf("%s - %02x <- %02x (was %02x)\n",
-                          format_addr(addr), p->regnr, new_b, b);
-            }
+            printf("%s - %02x <- %02x (was %02x)\n",
+                  format_addr(addr), p->regnr, (unsigned char)new_val, (unsigned char)old_val);
             break;
         case PATCH_WORD:
-            if (pci_read_word(addr, p->regnr, &w) >= 0)
-            {
-                unsigned new_w = (w & p->andmask) ^ p->xormask;
-                if (pci_write_word(addr, p->regnr, new_w) >= 0 && cmdline_verbose)
-                    printf("%s - %02x <- %04x (was %04x)\n",
-                          format_addr(addr), p->regnr, new_w, w);
-            }
+            printf("%s - %02x <- %04x (was %04x)\n",
+                  format_addr(addr), p->regnr, (unsigned)new_val, (unsigned)old_val);
             break;
         case PATCH_DWORD:
-            if (pci_read_dword(addr, p->regnr, &d) >= 0)
-            {
-                unsigned long new_d = (d & p->andmask) ^ p->xormask;
-                if (pci_write_dword(addr, p->regnr, new_d) >= 0 && cmdline_verbose)
-                    printf("%s - %02x <- %08lx (was %08lx)\n",
-                          format_addr(addr), p->regnr, new_d, d);
-            }
+            printf("%s - %02x <- %08lx (was %08lx)\n",
+                  format_addr(addr), p->regnr, new_val, old_val);
             break;
     }
 }
 
-void apply_cmdline_patches(dev_addr addr)
+// Writes the given bytes of value to the dword at reg, returns the bytes
+// that could not be written.
+unsigned int write_lanes(dev_addr addr, unsigned int reg, unsigned long value, unsigned int lanes)
 {
-    int idx;
-    for (idx = 0; idx < ARRAYSIZE(cmdline_patches); idx++)
+    unsigned int failed = 0;
+    unsigned int half;
+    if (lanes == 0xF)
+        return pci_write_dword(addr, reg, value) < 0 ? 0xF : 0;
+    for (half = 0; half < 4; half += 2)
     {
-        apply_patch(addr, &cmdline_patches[idx]);
+        unsigned int pair = (lanes >> half) & 3;
+        unsigned long shifted = value >> (8 * half);
+        if (pair == 3)
+        {
+            if (pci_write_word(addr, reg + half, (unsigned)(shifted & 0xFFFF)) < 0)
+                failed |= 3 << half;
+        }
+        else
+        {
+            if ((pair & 1) && pci_write_byte(addr, reg + half, (unsigned char)shifted) < 0)
+                failed |= 1 << half;
+            if ((pair & 2) && pci_write_byte(addr, reg + half + 1, (unsigned char)(shifted >> 8)) < 0)
+                failed |= 2 << half;
+        }
     }
+    return failed;
 }
 
-int main(int argc, char** argv)
+void apply_group(dev_addr addr, const struct job *j, const struct patch_group *g)
 {
-    char dummy;
-    iterator_fn *iter = iterate_all;
-    iterate_fn *handler = dump_device;
+    struct pending_print *pending = j->pending;
+    int pending_count = 0;
+    unsigned long value = 0;
+    unsigned int known = 0;     // bytes of value that reflect the register
+    unsigned int dirty = 0;     // bytes of value that need to be written
+    int idx;
 
-    if (argc > 1 && strcmp(argv[1], "-q") == 0)
+    for (idx = g->first; idx <= g->first + g->count; idx++)
     {
-        argc--;
-        argv++;
-        cmdline_verbose = 0;
-    }
+        const struct patch_info *p = &j->patches[idx];
+        unsigned int lanes, shift;
+        unsigned long mask, old_val, new_val, touched;
+        int is_read = idx < g->first + g->count && p->mode <= READ_DWORD;
 
-    if (argc > 1 && strcmp(argv[1], "-v") == 0)
-    {
-        argc--;
-        argv++;
-        cmdline_verbose = 2;
-    }
+        // flush before reads (they show what the hardware returns) and at the end
+        if ((dirty || pending_count) && (is_read || idx == g->first + g->count))
+        {
+            unsigned int failed;
+            int i;
+            // bus numbers of bridges, the cached device table might be outdated
+            if (dirty && g->reg == 0x18)
+                forget_device_table();
+            failed = write_lanes(addr, g->reg, value, dirty);
+            for (i = 0; i < pending_count; i++)
+                if (cmdline_verbose && !(patch_lanes(pending[i].p) & failed))
+                    print_patch(addr, pending[i].p, pending[i].new_val, pending[i].old_val);
+            pending_count = 0;
+            dirty = 0;
+            known = 0;
+        }
+        if (idx == g->first + g->count)
+            break;
 
-    if (argc == 2 && strcmp(argv[1], "-h") == 0)
+        lanes = patch_lanes(p);
+        shift = 8 * (p->regnr & 3);
+        mask = lane_mask(lanes);
+        if (p->mode != WRITE_BYTE && p->mode != WRITE_WORD && p->mode != WRITE_DWORD &&
+            (known & lanes) != lanes)
+        {
+            unsigned long hw;
+            if (pci_read_dword(addr, g->reg, &hw) < 0)
+                continue;
+            value = (hw & ~lane_mask(dirty)) | (value & lane_mask(dirty));
+            known = 0xF;
+        }
+        old_val = (value & mask) >> shift;
+        if (is_read)
+        {
+            print_patch(addr, p, old_val, 0);
+            continue;
+        }
+        new_val = ((old_val & p->andmask) ^ p->xormask) & (mask >> shift);
+        touched = (~p->andmask | p->xormask) & (mask >> shift);
+        if (p->mode == WRITE_BYTE || p->mode == WRITE_WORD || p->mode == WRITE_DWORD)
+        {
+            new_val = p->xormask & (mask >> shift);
+            touched = mask >> shift;
+        }
+        value = (value & ~mask) | (new_val << shift);
+        // No earlier patch of the group modified these lanes (see
+        // compile_patches), so old_val is what the hardware returned.
+        // Writing back what's already there is pointless, unless a bit the
+        // patch sets reads as one: in status registers, writing ones clears
+        // bits (write-1-to-clear).
+        if ((known & lanes) != lanes || new_val != old_val || (old_val & touched))
+            dirty |= lanes;
+        known |= lanes;
+        pending[pending_count].p = p;
+        pending[pending_count].new_val = new_val;
+        pending[pending_count].old_val = old_val;
+        pending_count++;
+    }
+}
+
+void apply_job_patches(dev_addr addr)
+{
+    int idx;
+    // no configuration cache here: a write can change other registers,
+    // e.g. the data register of an index/data window
+    for (idx = 0; idx < current_job->group_count; idx++)
     {
-        puts("PCI dump/patch utility for DOS, (C) 2022 Michael Karcher\n"
-             "Distributable under the MIT license - no warranty included\n"
-             "PCI [<devspec> [<patchspec>*]]\n"
-             "  <devspec> specifies one or multiple devices, like this:\n"
-             "    vvvv:dddd   - all cards with vendor id vvvv and device id dddd\n"
-             "    cc/ss/ii    - all cards with class cc, subclass ss and progif ii\n"
-             "    vvvv:dddd@n - n'th card matching vvvv:dddd\n"
-             "    cc/ss/ii@n  - n'th card matching cc/ss/ii\n"
-             "    bb:dd.f     - function f on device dd on bus bb\n"
-             "     n - a zero-based decimal number (multiple digits allowed)\n"
-             "     all other letters represent hexadecimal digits. The number of digits\n"
-             "     is required to be exactly the repetition count of that letter.\n"
-             "  <patchspec> specifies a register read or patch operation, like this\n"
-             "    rr / rr.B    - read a single byte\n"
-             "    rr.W         - read a 16-bit word\n"
-             "    rr.L / rr.D  - read a 32-bit long (aka dword)\n"
-             "    rr=xx        - write a single byte\n"
-             "    rr=xxxx      - write a 16-bit word\n"
-             "    rr=xxxxxxxx  - write a 32-bit dword\n"
-             "    rr=xx:mm     - byte read/mod/write: new value xx in bits given by mm\n"
-             "    rr=xxxx:mmmm - word r/m/w\n"
-             "    rr=xxxxxxxx:mmmmmmmm - long r/m/w\n"
-             "     In r/m/w operations, the value must not have any bits set that are not set\n"
-             "     in the mask. The ':' character can be replaced by '^', to enable the bit\n"
-             "     flip mode. Bits set in xx that are not the in the mask are allowed, and\n"
-             "     will be toggled. Example: 04=03^01 will set bit 0 and toggle bit 1\n"
-             "  If no patchspec is given, the selected devices are dumped");
-        return 0;
+        apply_group(addr, current_job, &current_job->groups[idx]);
     }
+}
 
-    if (pci_init() < 0)
+// Sets up the device selection of a job from a devspec. Instance numbers
+// are resolved when the job runs.
+int parse_devspec(const char *spec, struct job *j)
+{
+    char dummy;
+    size_t speclen = strlen(spec);
+    j->spec = spec;
+    if (speclen == 9 && spec[4] == ':')
     {
-        fputs("No PCI BIOS found\n", stderr);
-        return 1;
+        if (sscanf(spec, "%x:%x%c", &j->vendor, &j->device, &dummy) != 2)
+        {
+            fprintf(stderr, "bad device id specification %s\n", spec);
+            return -1;
+        }
+        j->iter = iterate_job_devid;
     }
-    if (cmdline_verbose > 1)
-        printf("PCI BIOS v%x.%02x found, managing busses 0..%d\n",
-                    bios_version >> 8, bios_version & 0xFF, last_bus);
+    else if(speclen == 8 && spec[2] == '/' && spec[5] == '/')
+    {
+        unsigned int cls, subcls, progif;
+        if (sscanf(spec, "%x/%x/%x%c", &cls, &subcls, &progif, &dummy) != 3)
+        {
+            fprintf(stderr, "bad class specification %s\n", spec);
+            return -1;
+        }
+        j->classcode = ((unsigned long)cls << 16) | (subcls << 8) | progif;
+        j->iter = iterate_job_class;
+    }
+    else if(speclen == 7 && spec[2] == ':' && spec[5] == '.')
+    {
+        unsigned int bus, dev, fn;
+        if (sscanf(spec, "%x:%x.%x%c", &bus, &dev, &fn, &dummy) != 3)
+        {
+            fprintf(stderr, "bad address specification %s\n", spec);
+            return -1;
+        }
+        j->addr = ADDR(bus, dev, fn);
+        j->iter = iterate_job_addr;
+    }
+    else if (speclen > 10 && spec[4] == ':' && spec[9] == '@')
+    {
+        // vendor/device id: vvvv:dddd
+        if (sscanf(spec, "%x:%x@%d%c", &j->vendor, &j->device, &j->instance, &dummy) != 3)
+        {
+            fprintf(stderr, "bad device id instance specification %s\n", spec);
+            return -1;
+        }
+        j->iter = iterate_job_devid_instance;
+    }
+    else if(speclen > 9 && spec[2] == '/' && spec[5] == '/' && spec[8] == '@')
+    {
+        unsigned int cls, subcls, progif;
+        if (sscanf(spec, "%x/%x/%x@%d%c", &cls, &subcls, &progif, &j->instance, &dummy) != 4)
+        {
+            fprintf(stderr, "bad class instance specification %s\n", spec);
+            return -1;
+        }
+        j->classcode = ((unsigned long)cls << 16) | (subcls << 8) | progif;
+        j->iter = iterate_job_class_instance;
+    }
+    else
+    {
+        fprintf(stderr, "unsupported parameter %s\n", spec);
+        return -1;
+    }
+    return 0;
+}
 
-    if (argc > 1)
+int parse_patchspec(const char *arg, struct patch_info *p)
+{
+    char dummy;
+    int badarg = 0;
+    int tempint, tempint2;
+    char patchkind;
+    size_t arglen = strlen(arg);
+    if (arglen == 2)
     {
-        size_t speclen = strlen(argv[1]);
-        if (speclen == 9 && argv[1][4] == ':')
+        if (sscanf(arg, "%x%c", &p->regnr, &dummy) != 1)
+            badarg = 1;
+        else
+            p->mode = READ_BYTE;
+    }
+    else if(arglen == 4 && arg[2] == '.')
+    {
+        char widthbyte;
+        if (sscanf(arg, "%x.%c%c", &p->regnr, &widthbyte, &dummy) != 2)
+            badarg = 1;
+        else
         {
-            if (sscanf(argv[1], "%x:%x%c", &cmdline_vendor, &cmdline_device, &dummy) != 2)
+            switch(widthbyte)
             {
-                fprintf(stderr, "bad device id specification %s\n", argv[1]);
-                return 1;
+                case 'b':
+                case 'B':
+                    p->mode = READ_BYTE;
+                    break;
+                case 'w':
+                case 'W':
+                    p->mode = READ_WORD;
+                    if (p->regnr & 1)
+                    {
+                        fprintf(stderr, "misaligned word %02x\n", p->regnr);
+                        badarg = 1;
+                    }
+                    break;
+                case 'd':
+                case 'D':
+                case 'l':
+                case 'L':
+                    p->mode = READ_DWORD;
+                    if (p->regnr & 3)
+                    {
+                        fprintf(stderr, "misaligned dword %02x\n", p->regnr);
+                        badarg = 1;
+                    }
+                    break;
+                default:
+                    badarg = 1;
+                    break;
             }
-            iter = iterate_cmdline_devid;
         }
-        else if(speclen == 8 && argv[1][2] == '/' && argv[1][5] == '/')
+    }
+    else if(arglen == 5 && arg[2] == '=')
+    {
+        if (sscanf(arg, "%x=%x%c", &p->regnr, &tempint, &dummy) != 2)
+            badarg = 1;
+        p->mode = WRITE_BYTE;
+        p->xormask = tempint;
+    }
+    else if(arglen == 7 && arg[2] == '=')
+    {
+        if (sscanf(arg, "%x=%x%c", &p->regnr, &tempint, &dummy) != 2)
+            badarg = 1;
+        else
         {
-            unsigned int cls, subcls, progif;
-            if (sscanf(argv[1], "%x/%x/%x%c", &cls, &subcls, &progif, &dummy) != 3)
+            p->mode = WRITE_WORD;
+            if (p->regnr & 1)
             {
-                fprintf(stderr, "bad class specification %s\n", argv[1]);
-                return 1;
+                fprintf(stderr, "misaligned word %02x\n", p->regnr);
+                badarg = 1;
             }
-            cmdline_class = ((unsigned long)cls << 16) | (subcls << 8) | progif;
-            iter = iterate_cmdline_class;
+            p->xormask = tempint;
         }
-        else if(speclen == 7 && argv[1][2] == ':' && argv[1][5] == '.')
+    }
+    else if(arglen == 11 && arg[2] == '=')
+    {
+        if (sscanf(arg, "%x=%lx%c", &p->regnr, &p->xormask, &dummy) != 2)
+            badarg = 1;
+        else
         {
-            unsigned int bus, dev, fn;
-            if (sscanf(argv[1], "%x:%x.%x%c", &bus, &dev, &fn, &dummy) != 3)
+            p->mode = WRITE_DWORD;
+            if (p->regnr & 3)
             {
-                fprintf(stderr, "bad address specification %s\n", argv[1]);
-                return 1;
+                fprintf(stderr, "misaligned dword %02x\n", p->regnr);
+                badarg = 1;
             }
-            cmdline_addr = ADDR(bus, dev, fn);
-            iter = iterate_cmdline_addr;
         }
-        else if (speclen > 10 && argv[1][4] == ':' && argv[1][9] == '@')
+    }
+    else if(arglen == 8 && arg[2] == '=' && (arg[5] == ':' || arg[5] == '^'))
+    {
+        if (sscanf(arg, "%x=%x%c%x%c", &p->regnr, &tempint, &patchkind, &tempint2, &dummy) != 4)
+            badarg = 1;
+        else
         {
-            int cmdline_idx;
-            // vendor/device id: vvvv:dddd
-            if (sscanf(argv[1], "%x:%x@%d%c", &cmdline_vendor, &cmdline_device, &cmdline_idx, &dummy) != 3)
+            if (patchkind == ':' && (tempint & ~tempint2) != 0)
             {
-                fprintf(stderr, "bad device id instance specification %s\n", argv[1]);
-                return 1;
+                fprintf(stderr, "value %02x not inside mask %02x\n", tempint, tempint2);
+                badarg = 1;
             }
-            if (dev_by_id(cmdline_vendor, cmdline_device, cmdline_idx, &cmdline_addr) < 0)
+            else
             {
-                fprintf(stderr, "device %s not found\n", argv[1]);
-                return 1;
+                p->mode = PATCH_BYTE;
+                p->xormask = tempint;
+                p->andmask = ~tempint2;
             }
-            iter = iterate_cmdline_addr;
         }
-        else if(speclen > 9 && argv[1][2] == '/' && argv[1][5] == '/' && argv[1][8] == '@')
+    }
+    else if(arglen == 12 && arg[2] == '=' && (arg[7] == ':' || arg[7] == '^'))
+    {
+        if (sscanf(arg, "%x=%x%c%x%c", &p->regnr, &tempint, &patchkind, &tempint2, &dummy) != 4)
+            badarg = 1;
+        else
         {
-            unsigned int cls, subcls, progif;
-            int cmdline_idx;
-            if (sscanf(argv[1], "%x/%x/%x@%d%c", &cls, &subcls, &progif, &cmdline_idx, &dummy) != 4)
+            if (patchkind == ':' && (tempint & ~tempint2) != 0)
             {
-                fprintf(stderr, "bad class instance specification %s\n", argv[1]);
-                return 1;
+                fprintf(stderr, "value %04x not inside mask %04x\n", tempint, tempint2);
+                badarg = 1;
             }
-            cmdline_class = ((unsigned long)cls << 16) | (subcls << 8) | progif;
-            if (dev_by_class(cmdline_class, cmdline_idx, &cmdline_addr) < 0)
+            else if (p->regnr & 1)
             {
-                fprintf(stderr, "device %s not found\n", argv[1]);
-                return 1;
+                fprintf(stderr, "misaligned word %02x\n", p->regnr);
+                badarg = 1;
+            }
+            else
+            {
+                p->mode = PATCH_WORD;
+                p->xormask = tempint;
+                p->andmask = ~tempint2;
             }
-            iter = iterate_cmdline_addr;
         }
+    }
+    else if(arglen == 20 && arg[2] == '=' && (arg[11] == ':' || arg[11] == '^'))
+    {
+        if (sscanf(arg, "%x=%lx%c%lx%c", &p->regnr, &p->xormask, &patchkind, &p->andmask, &dummy) != 4)
+            badarg = 1;
         else
         {
-            fprintf(stderr, "unsupported parameter %s\n", argv[1]);
-            return 1;
+            p->andmask ^= 0xFFFFFFFFUL;
+            if (patchkind == ':' && (p->xormask & p->andmask) != 0)
+            {
+                fprintf(stderr, "value %08lx not inside mask %08lx\n", p->xormask, p->andmask ^ 0xFFFFFFFFUL);
+                badarg = 1;
+            }
+            else if (p->regnr & 3)
+            {
+                fprintf(stderr, "misaligned dword %02x\n", p->regnr);
+                badarg = 1;
+            }
+            else
+            {
+                p->mode = PATCH_DWORD;
+            }
         }
     }
+    else
+    {
+        badarg = 1;
+    }
+    if (badarg)
+    {
+        fprintf(stderr, "bad patch specification %s\n", arg);
+        return -1;
+    }
+    return 0;
+}
+
+// Reads the next word of a script into buf. Words are separated by white
+// space, '#' and ';' start a comment that extends to the end of the line.
+// Returns -1 at the end of the file and 1 if the word didn't fit into buf.
+int read_word(FILE *f, char *buf, int size, int *line)
+{
+    int ch;
+    int len = 0;
+    do
+    {
+        ch = getc(f);
+        if (ch == '#' || ch == ';')
+        {
+            while (ch != '\n' && ch != EOF)
+                ch = getc(f);
+        }
+        if (ch == '\n')
+            (*line)++;
+    } while (ch != EOF && isspace(ch));
+    if (ch == EOF)
+        return -1;
+    while (ch != EOF && !isspace(ch) && ch != '#' && ch != ';')
+    {
+        if (len < size - 1)
+            buf[len] = (char)ch;
+        len++;
+        ch = getc(f);
+    }
+    if (ch != EOF)
+        ungetc(ch, f);
+    buf[len < size ? len : size - 1] = '\0';
+    return len < size ? 0 : 1;
+}
 
-    if (argc > 2)
+// Reads a script into an array of jobs: Every devspec starts a new job, the
+// patchspecs following it are applied to the devices it selects. The whole
+// script is checked before anything is executed.
+int read_script(const char *filename, struct job **jobs, int *job_count)
+{
+    char word[24];
+    int line = 1;
+    int status;
+    int job_capacity = 0, patch_capacity = 0;
+    struct job *j = NULL;
+    FILE *f = fopen(filename, "r");
+    if (!f)
+    {
+        perror(filename);
+        return -1;
+    }
+    *jobs = NULL;
+    *job_count = 0;
+    while ((status = read_word(f, word, sizeof word, &line)) >= 0)
     {
-        int i;
-        int tempint, tempint2;
-        char patchkind;
-        // switch from "lspci" to "setpci" mode
-        handler = apply_cmdline_patches;
-        for (i = 2; i < argc; i++)
+        if (status > 0)
+        {
+            fprintf(stderr, "unsupported parameter %s...\n", word);
+            break;
+        }
+        if (strlen(word) >= 2 && (word[2] == '\0' || word[2] == '.' || word[2] == '='))
         {
-            int badarg = 0;
-            char *arg = argv[i];
-            struct patch_info *p = &cmdline_patches[i-2];
-            size_t arglen = strlen(arg);
-            if (arglen == 2)
+            if (!j)
             {
-                if (sscanf(arg, "%x%c", &p->regnr) != 1)
-                    badarg = 1;
-                else
-                    p->mode = READ_BYTE;
+                fprintf(stderr, "patch specification %s without device\n", word);
+                status = 1;
+                break;
             }
-            else if(arglen == 4 && arg[2] == '.')
+            if (j->patch_count == patch_capacity)
             {
-                char widthbyte;
-                if (sscanf(arg, "%x.%c%c", &p->regnr, &widthbyte, &dummy) != 2)
-                    badarg = 1;
-                else
+                struct patch_info *p;
+                patch_capacity = patch_capacity ? 2 * patch_capacity : 8;
+                p = realloc(j->patches, patch_capacity * sizeof *p);
+                if (!p)
                 {
-                    switch(widthbyte)
-                    {
-                        case 'b':
-                        case 'B':
-                            p->mode = READ_BYTE;
-                            break;
-                        case 'w':
-                        case 'W':
-                            p->mode = READ_WORD;
-                            if (p->regnr & 1)
-                            {
-                                fprintf(stderr, "misaligned word %02x\n", p->regnr);
-                                badarg = 1;
-                            }
-                            break;
-                        case 'd':
-                        case 'D':
-                        case 'l':
-                        case 'L':
-                            p->mode = READ_DWORD;
-                            if (p->regnr & 3)
-                            {
-                                fprintf(stderr, "misaligned dword %02x\n", p->regnr);
-                                badarg = 1;
-                            }
-                            break;
-                        default:
-                            badarg = 1;
-                            break;
-                    }
+                    fputs("out of memory\n", stderr);
+                    status = 1;
+                    break;
                 }
+                j->patches = p;
             }
-            else if(arglen == 5 && arg[2] == '=')
+            if (parse_patchspec(word, &j->patches[j->patch_count]) < 0)
             {
-                if (sscanf(arg, "%x=%x%c", &p->regnr, &tempint, &dummy) != 2)
-                    badarg = 1;
-                p->mode = WRITE_BYTE;
-                p->xormask = tempint;
+                status = 1;
+                break;
             }
-            else if(arglen == 7 && arg[2] == '=')
+            j->patch_count++;
+        }
+        else
+        {
+            char *spec = malloc(strlen(word) + 1);
+            if (*job_count == job_capacity)
             {
-                if (sscanf(arg, "%x=%x%c", &p->regnr, &tempint, &dummy) != 2)
-                    badarg = 1;
+                struct job *grown;
+                job_capacity = job_capacity ? 2 * job_capacity : 8;
+                grown = realloc(*jobs, job_capacity * sizeof *grown);
+                if (!grown)
+                    spec = NULL;
                 else
-                {
-                    p->mode = WRITE_WORD;
-                    if (p->regnr & 1)
-                    {
-                        fprintf(stderr, "misaligned word %02x\n", p->regnr);
-                        badarg = 1;
-                    }
-                    p->xormask = tempint;
-                }
+                    *jobs = grown;
             }
-            else if(arglen == 11 && arg[2] == '=')
+            if (!spec)
             {
-                if (sscanf(arg, "%x=%lx%c", &p->regnr, &p->xormask, &dummy) != 2)
-                    badarg = 1;
-                else
-                {
-                    p->mode = WRITE_DWORD;
-                    if (p->regnr & 3)
-                    {
-                        fprintf(stderr, "misaligned dword %02x\n", p->regnr);
-                        badarg = 1;
-                    }
-                }
+                fputs("out of memory\n", stderr);
+                status = 1;
+                break;
             }
-            else if(arglen == 8 && arg[2] == '=' && (arg[5] == ':' || arg[5] == '^'))
+            j = &(*jobs)[(*job_count)++];
+            memset(j, 0, sizeof *j);
+            patch_capacity = 0;
+            if (parse_devspec(strcpy(spec, word), j) < 0)
             {
-                if (sscanf(arg, "%x=%x%c%x%c", &p->regnr, &tempint, &patchkind, &tempint2, &dummy) != 4)
-                    badarg = 1;
-                else
-                {
-                    if (patchkind == ':' && (tempint & ~tempint2) != 0)
-                    {
-                        fprintf(stderr, "value %02x not inside mask %02x\n", tempint, tempint2);
-                        badarg = 1;
-                    }
-                    else
-                    {
-                        p->mode = PATCH_BYTE;
-                        p->xormask = tempint;
-                        p->andmask = ~tempint2;
-                    }
-                }
+                status = 1;
+                break;
             }
-            else if(arglen == 12 && arg[2] == '=' && (arg[7] == ':' || arg[7] == '^'))
+        }
+    }
+    fclose(f);
+    if (status > 0)
+    {
+        fprintf(stderr, "error in line %d of %s\n", line, filename);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    struct job cmdline_job;
+    struct job *jobs = &cmdline_job;
+    int job_count = 1;
+    int i;
+    const char *replay_file = NULL;
+    const char *capture_file = NULL;
+
+    if (argc > 1 && strcmp(argv[1], "-q") == 0)
+    {
+        argc--;
+        argv++;
+        cmdline_verbose = 0;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "-v") == 0)
+    {
+        argc--;
+        argv++;
+        cmdline_verbose = 2;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "-a") == 0)
+    {
+        argc--;
+        argv++;
+        scan_devices = iterate_all;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "-r") == 0)
+    {
+        argc--;
+        argv++;
+        enum_rescan = 1;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "-b") == 0)
+    {
+        argc--;
+        argv++;
+        pci_access = PCI_ACCESS_BIOS;
+    }
+    else if (argc > 1 && strcmp(argv[1], "-d") == 0)
+    {
+        argc--;
+        argv++;
+        pci_access = PCI_ACCESS_CF8;
+    }
+    else if (argc > 2 && strcmp(argv[1], "-f") == 0)
+    {
+        replay_file = argv[2];
+        argc -= 2;
+        argv += 2;
+    }
+
+    if (argc > 2 && strcmp(argv[1], "-w") == 0)
+    {
+        capture_file = argv[2];
+        argc -= 2;
+        argv += 2;
+    }
+
+    if (argc == 2 && strcmp(argv[1], "-h") == 0)
+    {
+        puts("PCI dump/patch utility for DOS, (C) 2022 Michael Karcher\n"
+             "Distributable under the MIT license - no warranty included\n"
+             "PCI [-q|-v] [-a] [-r] [-b|-d|-f <image>] [-w <image>] [<devspec> [<patchspec>*]]\n"
+             "PCI [-q|-v] [-a] [-r] [-b|-d|-f <image>] [-w <image>] @<script>\n"
+             "  -q / -v     - less / more output\n"
+             "  -a          - scan all busses, not just those found behind bridges\n"
+             "  -r          - rescan the busses, ignoring the device table in %TEMP%\n"
+             "  -b          - access configuration space through the PCI BIOS only\n"
+             "  -d          - access configuration space directly (mechanism #1)\n"
+             "  -f <image>  - work on a configuration space image instead of the hardware\n"
+             "  -w <image>  - save the selected devices to a configuration space image\n"
+             "  <devspec> specifies one or multiple devices, like this:\n"
+             "    vvvv:dddd   - all cards with vendor id vvvv and device id dddd\n"
+             "    cc/ss/ii    - all cards with class cc, subclass ss and progif ii\n"
+             "    vvvv:dddd@n - n'th card matching vvvv:dddd\n"
+             "    cc/ss/ii@n  - n'th card matching cc/ss/ii\n"
+             "    bb:dd.f     - function f on device dd on bus bb\n"
+             "     n - a zero-based decimal number (multiple digits allowed)\n"
+             "     all other letters represent hexadecimal digits. The number of digits\n"
+             "     is required to be exactly the repetition count of that letter.\n"
+             "  <patchspec> specifies a register read or patch operation, like this\n"
+             "    rr / rr.B    - read a single byte\n"
+             "    rr.W         - read a 16-bit word\n"
+             "    rr.L / rr.D  - read a 32-bit long (aka dword)\n"
+             "    rr=xx        - write a single byte\n"
+             "    rr=xxxx      - write a 16-bit word\n"
+             "    rr=xxxxxxxx  - write a 32-bit dword\n"
+             "    rr=xx:mm     - byte read/mod/write: new value xx in bits given by mm\n"
+             "    rr=xxxx:mmmm - word r/m/w\n"
+             "    rr=xxxxxxxx:mmmmmmmm - long r/m/w\n"
+             "     In r/m/w operations, the value must not have any bits set that are not set\n"
+             "     in the mask. The ':' character can be replaced by '^', to enable the bit\n"
+             "     flip mode. Bits set in xx that are not the in the mask are allowed, and\n"
+             "     will be toggled. Example: 04=03^01 will set bit 0 and toggle bit 1\n"
+             "  If no patchspec is given, the selected devices are dumped\n"
+             "  <script> is a file with any number of devspecs, each followed by its\n"
+             "  patchspecs. The PCI busses are scanned only once. Text after # or ; is ignored");
+        return 0;
+    }
+
+    if (replay_file)
+    {
+        if (pci_image_load(replay_file) < 0)
+        {
+            fprintf(stderr, "bad image file %s\n", replay_file);
+            return 1;
+        }
+    }
+    else
+    {
+        switch (pci_init())
+        {
+            case 0:
+                enum_cache_init();
+                break;
+            case -2:
+                fputs("Configuration mechanism #1 not available\n", stderr);
+                return 1;
+            case -3:
+                fputs("-b and -d are not available with the sysfs backend\n", stderr);
+                return 1;
+            default:
+                fputs("No PCI BIOS found\n", stderr);
+                return 1;
+        }
+    }
+    if (cmdline_verbose > 1)
+    {
+        if (bios_version != 0)
+            printf("PCI BIOS v%x.%02x found, managing busses 0..%d\n",
+                        bios_version >> 8, bios_version & 0xFF, last_bus);
+        printf("Using %s for configuration space access\n", pci_backend->name);
+    }
+
+    if (argc > 1 && argv[1][0] == '@')
+    {
+        if (argc > 2)
+        {
+            fputs("a script can't be combined with other parameters\n", stderr);
+            return 1;
+        }
+        if (read_script(argv[1] + 1, &jobs, &job_count) < 0)
+            return 1;
+    }
+    else
+    {
+        memset(&cmdline_job, 0, sizeof cmdline_job);
+        cmdline_job.iter = iterate_devices;
+        if (argc > 1 && parse_devspec(argv[1], &cmdline_job) < 0)
+            return 1;
+        if (argc > 2)
+        {
+            cmdline_job.patch_count = argc - 2;
+            cmdline_job.patches = malloc((argc - 2) * sizeof *cmdline_job.patches);
+            if (!cmdline_job.patches)
             {
-                if (sscanf(arg, "%x=%x%c%x%c", &p->regnr, &tempint, &patchkind, &tempint2, &dummy) != 4)
-                    badarg = 1;
-                else
-                {
-                    if (patchkind == ':' && (tempint & ~tempint2) != 0)
-                    {
-                        fprintf(stderr, "value %04x not inside mask %04x\n", tempint, tempint2);
-                        badarg = 1;
-                    }
-                    else
-                    {
-                        p->mode = PATCH_WORD;
-                        p->xormask = tempint;
-                        p->andmask = ~tempint2;
-                    }
-                }
+                fputs("out of memory\n", stderr);
+                return 1;
             }
-            else if(arglen == 20 && arg[2] == '=' && (arg[11] == ':' || arg[11] == '^'))
+            for (i = 2; i < argc; i++)
             {
-                if (sscanf(arg, "%x=%lx%c%lx%c", &p->regnr, &p->xormask, &patchkind, &p->andmask, &dummy) != 4)
-                    badarg = 1;
-                else
-                {
-                    p->andmask ^= 0xFFFFFFFFUL;
-                    if (patchkind == ':' && (p->xormask & p->andmask) != 0)
-                    {
-                        fprintf(stderr, "value %08lx not inside mask %08lx\n", p->xormask, ~p->andmask);
-                        badarg = 1;
-                    }
-                    else
-                    {
-                        p->mode = PATCH_DWORD;
-                    }
-                }
+                if (parse_patchspec(argv[i], &cmdline_job.patches[i-2]) < 0)
+                    return 1;
             }
-            else
+        }
+    }
+
+    if (capture_file)
+    {
+        for (i = 0; i < job_count; i++)
+        {
+            if (jobs[i].patch_count > 0)
             {
-                badarg = 1;
+                fputs("patch specifications can't be used with -w\n", stderr);
+                return 1;
             }
-            if (badarg)
+        }
+        if (pci_image_create(capture_file) < 0)
+        {
+            perror(capture_file);
+            return 1;
+        }
+    }
+
+    for (i = 0; i < job_count; i++)
+    {
+        struct job *j = &jobs[i];
+        iterate_fn *handler = capture_file ? capture_device : dump_device;
+        if (j->patch_count > 0)
+        {
+            // switch from "lspci" to "setpci" mode
+            if (compile_patches(j) < 0)
             {
-                fprintf(stderr, "bad patch specification %s\n", arg);
+                fputs("out of memory\n", stderr);
                 return 1;
             }
+            handler = apply_job_patches;
         }
+        current_job = j;
+        j->iter(handler);
     }
-
-    iter(handler);
-    return 0;
+    if (capture_file && pci_image_close() < 0)
+    {
+        perror(capture_file);
+        return 1;
+    }
+    if (cmdline_verbose > 1)
+        printf("%lu configuration space accesses, %lu more saved by caching\n",
+                    pci_cycles, pci_cycles_saved);
+    return exit_status;
 }
 
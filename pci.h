@@ -1,15 +1,89 @@
 typedef unsigned int dev_addr;
 #define ADDR(bus,dev,fn) (((bus) << 8) | ((dev) << 3) | (fn))
 
+#define CMD_IO 1
+#define CMD_MEM 2
+#define CMD_MASTER 4
+
 extern unsigned char last_bus;
 extern unsigned int bios_version;
 
+#define PCI_ACCESS_AUTO 0   // probe mechanism #1, fall back to the BIOS
+#define PCI_ACCESS_BIOS 1   // INT 1Ah calls
+#define PCI_ACCESS_CF8  2   // configuration mechanism #1 via ports CF8/CFC
+extern unsigned char pci_access;
+
+// An access backend, selected by pci_init according to pci_access.
+// read_block is optional and reads a range of registers in one go.
+typedef struct {
+    const char *name;
+    int (*read_byte)(dev_addr dev, unsigned int reg, unsigned char* data);
+    int (*read_word)(dev_addr dev, unsigned int reg, unsigned* data);
+    int (*read_dword)(dev_addr dev, unsigned int reg, unsigned long* data);
+    int (*write_byte)(dev_addr dev, unsigned int reg, unsigned char data);
+    int (*write_word)(dev_addr dev, unsigned int reg, unsigned data);
+    int (*write_dword)(dev_addr dev, unsigned int reg, unsigned long data);
+    int (*read_block)(dev_addr dev, unsigned int reg, unsigned char* buf, unsigned int len);
+} pci_backend_t;
+
+extern const pci_backend_t *pci_backend;
+extern const pci_backend_t pci_bios_backend;    // pcilib.c
+extern const pci_backend_t pci_cf8_backend;     // pcilib.c
+extern const pci_backend_t pci_sysfs_backend;   // pcisysfs.c, Linux only
+extern const pci_backend_t pci_image_backend;   // pciimage.c
+
+// Returns 0 on success, -1 without a PCI BIOS, -2 if mechanism #1 was
+// requested but doesn't work and -3 if pci_access asks for a method the
+// platform doesn't offer.
 int pci_init(void);
-int dev_by_id(unsigned int vendor, unsigned int device, int index, dev_addr *addr);
-int dev_by_class(unsigned long classcode, int index, dev_addr *dev);
+int pci_cf8_probe(void);
 int pci_read_byte(dev_addr dev, unsigned int reg, unsigned char* data);
 int pci_read_word(dev_addr dev, unsigned int reg, unsigned* data);
 int pci_read_dword(dev_addr dev, unsigned int reg, unsigned long* data);
 int pci_write_byte(dev_addr dev, unsigned int reg, unsigned char data);
 int pci_write_word(dev_addr dev, unsigned int reg, unsigned data);
 int pci_write_dword(dev_addr dev, unsigned int reg, unsigned long data);
+
+// The accessors above serve reads of one function from a snapshot between
+// pci_cache_open and pci_cache_close. prefetch is the number of bytes
+// expected to be needed. They are loaded right away if the backend can read
+// blocks, otherwise every dword is fetched on first use.
+int pci_cache_open(dev_addr dev, unsigned int prefetch);
+void pci_cache_close(void);
+extern unsigned long pci_cycles;        // backend accesses issued
+extern unsigned long pci_cycles_saved;  // reads served from the cache
+
+// Resolves "bb:dd.f$b+offset" to an address inside BAR b of that function.
+// Returns 1 for I/O BARs, 0 for memory BARs and -1 (with a message) on error.
+int pci_bar_address(const char* spec, unsigned long* address);
+// Like pci_bar_address, but sizes the BAR and also returns the function and
+// the number of bytes from the address to the end of the BAR.
+int pci_bar_region(const char* spec, dev_addr* dev, unsigned long* address, unsigned long* remaining);
+// Finds the register and size of the expansion ROM BAR of a function, and
+// the address to enable it at: its assigned address if it has one, or else
+// a free range in the memory window of the bridge above it. Only if share_bar
+// is set, the address of another memory BAR of the function is used as the
+// last resort. Sizes the BARs of the function only, and leaves all registers
+// unchanged.
+int pci_rom_window(dev_addr dev, int share_bar, unsigned* reg, unsigned long* address, unsigned long* size);
+
+// Sizes all BARs of a function with decoding turned off only once.
+// value[] receives the contents of BARs 0..5, probe[] what they read back
+// after writing all ones. Index PROBE_ROM is the expansion ROM BAR. BARs
+// that don't exist in the header type of the function are left at 0.
+#define PROBE_ROM 6
+#define PROBE_COUNT 7
+typedef struct {
+    unsigned long value[PROBE_COUNT];
+    unsigned long probe[PROBE_COUNT];
+} bar_record_t;
+int pci_probe_bars(dev_addr dev, bar_record_t *bars);
+
+// Configuration space images. pci_image_load installs pci_image_backend.
+int pci_image_create(const char *filename);
+int pci_image_add(dev_addr dev);
+int pci_image_close(void);
+int pci_image_load(const char *filename);
+
+void my_outpd(unsigned port, unsigned long value);
+unsigned long my_inpd(unsigned port);
@@ -0,0 +1,140 @@
+#include "pci.h"
+
+unsigned char last_bus = 0;
+unsigned int bios_version;
+unsigned char pci_access = PCI_ACCESS_AUTO;
+const pci_backend_t *pci_backend;
+
+unsigned long pci_cycles = 0;
+unsigned long pci_cycles_saved = 0;
+
+// Snapshot of the configuration space of one function. Registers are
+// fetched as full dwords, either up front by pci_cache_open or on first use,
+// and every later byte/word/dword read in that dword is served from memory.
+static int cache_active = 0;
+static dev_addr cache_dev;
+static unsigned long cache_data[64];
+static unsigned char cache_valid[64];
+
+static int raw_read_dword(dev_addr dev, unsigned int reg, unsigned long* data)
+{
+    pci_cycles++;
+    return pci_backend->read_dword(dev, reg, data);
+}
+
+// Returns 0 if the dword containing reg is available in the cache, so the
+// caller can extract its value from cache_data.
+static int cache_fetch(dev_addr dev, unsigned int reg)
+{
+    unsigned int idx = (reg >> 2) & 0x3F;
+    if (!cache_active || dev != cache_dev)
+        return -1;
+    if (cache_valid[idx])
+    {
+        pci_cycles_saved++;
+        return 0;
+    }
+    if (raw_read_dword(dev, reg & 0xFC, &cache_data[idx]) < 0)
+        return -1;
+    cache_valid[idx] = 1;
+    return 0;
+}
+
+static void cache_invalidate(dev_addr dev)
+{
+    unsigned int idx;
+    if (cache_active && dev == cache_dev)
+    {
+        for (idx = 0; idx < 64; idx++)
+            cache_valid[idx] = 0;
+    }
+}
+
+int pci_cache_open(dev_addr dev, unsigned int prefetch)
+{
+    unsigned char block[0x100];
+    unsigned int reg;
+    for (reg = 0; reg < 64; reg++)
+        cache_valid[reg] = 0;
+    cache_dev = dev;
+    cache_active = 1;
+    if (prefetch > 0x100)
+        prefetch = 0x100;
+    prefetch &= ~3;
+    // without block reads, fetching on first use is never more expensive
+    if (prefetch == 0 || !pci_backend->read_block)
+        return 0;
+    pci_cycles++;
+    if (pci_backend->read_block(dev, 0, block, prefetch) < 0)
+        return -1;
+    for (reg = 0; reg < prefetch; reg += 4)
+    {
+        cache_data[reg >> 2] = block[reg] |
+                               ((unsigned)block[reg + 1] << 8) |
+                               ((unsigned long)block[reg + 2] << 16) |
+                               ((unsigned long)block[reg + 3] << 24);
+        cache_valid[reg >> 2] = 1;
+    }
+    return 0;
+}
+
+void pci_cache_close(void)
+{
+    cache_active = 0;
+}
+
+int pci_read_byte(dev_addr dev, unsigned int reg, unsigned char* data)
+{
+    if (cache_fetch(dev, reg) >= 0)
+    {
+        *data = (unsigned char)(cache_data[reg >> 2] >> (8 * (reg & 3)));
+        return 0;
+    }
+    pci_cycles++;
+    return pci_backend->read_byte(dev, reg, data);
+}
+
+int pci_read_word(dev_addr dev, unsigned int reg, unsigned* data)
+{
+    if (cache_fetch(dev, reg) >= 0)
+    {
+        *data = (unsigned)(cache_data[reg >> 2] >> (8 * (reg & 2))) & 0xFFFF;
+        return 0;
+    }
+    pci_cycles++;
+    return pci_backend->read_word(dev, reg, data);
+}
+
+int pci_read_dword(dev_addr dev, unsigned int reg, unsigned long* data)
+{
+    if (cache_fetch(dev, reg) >= 0)
+    {
+        *data = cache_data[reg >> 2];
+        return 0;
+    }
+    return raw_read_dword(dev, reg, data);
+}
+
+// Writes always go to the hardware. The whole snapshot of the function is
+// dropped, as registers like BARs don't read back what has been written,
+// and a write can change other registers too (index/data windows).
+int pci_write_byte(dev_addr dev, unsigned int reg, unsigned char data)
+{
+    cache_invalidate(dev);
+    pci_cycles++;
+    return pci_backend->write_byte(dev, reg, data);
+}
+
+int pci_write_word(dev_addr dev, unsigned int reg, unsigned data)
+{
+    cache_invalidate(dev);
+    pci_cycles++;
+    return pci_backend->write_word(dev, reg, data);
+}
+
+int pci_write_dword(dev_addr dev, unsigned int reg, unsigned long data)
+{
+    cache_invalidate(dev);
+    pci_cycles++;
+    return pci_backend->write_dword(dev, reg, data);
+}
@@ -0,0 +1,430 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pci.h"
+
+// Checks "bb:dd.f$b+offset" and the function it refers to
+static int parse_bar_spec(const char* spec, dev_addr* addr, unsigned* bar,
+                          unsigned long* offset, unsigned long* bar_val)
+{
+    char dummy;
+    unsigned bus, dev, fn;
+    unsigned vendor;
+    size_t speclen = strlen(spec);
+    if (speclen <= 10 || speclen > 18 ||
+        spec[2] != ':' || spec[5] != '.' || spec[7] != '$' || spec[9] != '+' ||
+        sscanf(spec, "%x:%x.%u$%u+%lx%c", &bus, &dev, &fn, bar, offset, &dummy) != 5)
+    {
+        return -1;
+    }
+    if (pci_init() < 0)
+    {
+        fputs("No PCI BIOS found\n", stderr);
+        return -1;
+    }
+    if (bus > last_bus)
+    {
+        fputs("Bad bus number\n", stderr);
+        return -1;
+    }
+    if (dev > 31)
+    {
+        fputs("Invalid device number\n", stderr);
+        return -1;
+    }
+    if (fn > 7)
+    {
+        fputs("Invalid function number\n", stderr);
+        return -1;
+    }
+    if (*bar > 5)
+    {
+        fputs("Invalid BAR number\n", stderr);
+        return -1;
+    }
+    *addr = ADDR(bus, dev, fn);
+    if (pci_read_word(*addr, 0, &vendor) < 0 || vendor == 0xFFFF)
+    {
+        fputs("specified PCI device does not exist\n", stderr);
+        return -1;
+    }
+    if (pci_read_dword(*addr, 0x10 + 4 * *bar, bar_val) < 0 || *bar_val == 0x00000000)
+    {
+        fputs("specified base address register does not exist\n", stderr);
+        return -1;
+    }
+    return 0;
+}
+
+int pci_bar_address(const char* spec, unsigned long* address)
+{
+    dev_addr addr;
+    unsigned bar;
+    unsigned long offset;
+    unsigned long bar_val;
+    if (parse_bar_spec(spec, &addr, &bar, &offset, &bar_val) < 0)
+        return -1;
+    if (bar_val & 1)
+    {
+        *address = (bar_val & ~3UL) + offset;
+        return 1;
+    }
+    *address = (bar_val & ~0xFUL) + offset;
+    return 0;
+}
+
+int pci_bar_region(const char* spec, dev_addr* dev, unsigned long* address, unsigned long* remaining)
+{
+    bar_record_t bars;
+    unsigned bar;
+    unsigned long offset;
+    unsigned long bar_val;
+    unsigned long size;
+    int is_io;
+    if (parse_bar_spec(spec, dev, &bar, &offset, &bar_val) < 0)
+        return -1;
+    if (pci_probe_bars(*dev, &bars) < 0)
+    {
+        fputs("sizing the base address register failed\n", stderr);
+        return -1;
+    }
+    is_io = bar_val & 1;
+    if (!is_io && (bar_val & 6) == 4 && (bar == 5 || bars.value[bar + 1] != 0))
+    {
+        fputs("specified base address register is above 4GB\n", stderr);
+        return -1;
+    }
+    size = (~(bars.probe[bar] & (is_io ? ~3UL : ~0xFUL)) + 1) & 0xFFFFFFFFUL;
+    if (is_io)
+        size &= 0xFFFF;     // the upper half of I/O BARs may be hardwired to 0
+    if (offset >= size)
+    {
+        fputs("offset is beyond the end of the base address register\n", stderr);
+        return -1;
+    }
+    *address = (bar_val & (is_io ? ~3UL : ~0xFUL)) + offset;
+    *remaining = size - offset;
+    return is_io;
+}
+
+// Memory ranges decoded on the bus of a ROM being mapped, end inclusive.
+// Only the BARs of the function whose ROM is mapped are sized. For other
+// functions, just the address is known, and a BAR can't be larger than its
+// alignment or reach into the next range.
+struct used_range {
+    unsigned long start, end;
+    int exact;
+};
+
+static struct used_range *used;
+static unsigned used_count, used_capacity;
+
+static int add_used(unsigned long start, unsigned long size, int exact)
+{
+    struct used_range *grown;
+    if (size == 0)
+        return 0;
+    if (used_count == used_capacity)
+    {
+        grown = realloc(used, (used_capacity + 32) * sizeof *used);
+        if (!grown)
+        {
+            fputs("out of memory\n", stderr);
+            return -1;
+        }
+        used = grown;
+        used_capacity += 32;
+    }
+    used[used_count].start = start;
+    used[used_count].end = start + size - 1;
+    used[used_count].exact = exact;
+    used_count++;
+    return 0;
+}
+
+// An address of a BAR that has not been sized, which isn't larger than
+// the alignment of its address
+static int add_unsized(unsigned long address)
+{
+    if (address == 0)
+        return 0;
+    return add_used(address, (address & (~address + 1)) & 0xFFFFFFFFUL, 0);
+}
+
+// Reads the memory window (reg 0x20) or the prefetchable window (reg 0x24)
+// of a bridge. Returns 0 if the window is closed or above 4GB.
+static int bridge_window(dev_addr dev, unsigned reg, unsigned long* base, unsigned long* size)
+{
+    unsigned lo, hi;
+    unsigned long upper_base = 0, upper_limit = 0;
+    unsigned long limit;
+    if (pci_read_word(dev, reg, &lo) < 0 || pci_read_word(dev, reg + 2, &hi) < 0)
+        return -1;
+    if (reg == 0x24 && (lo & 0xF) == 1 &&
+        (pci_read_dword(dev, 0x28, &upper_base) < 0 || pci_read_dword(dev, 0x2C, &upper_limit) < 0))
+    {
+        return -1;
+    }
+    *base = (unsigned long)(lo & 0xFFF0) << 16;
+    limit = ((unsigned long)(hi & 0xFFF0) << 16) | 0xFFFFF;
+    if (upper_base != 0 || upper_limit != 0 || *base > limit)
+        return 0;
+    *size = limit - *base + 1;
+    return 1;
+}
+
+// Collects the memory BARs, the assigned ROM BARs and the bridge windows of
+// all functions on the bus of dev, whose BARs are passed in sized. Ranges of
+// other functions are cut at the next range and the end of the bridge
+// window.
+static int collect_used(dev_addr dev, const bar_record_t* own, unsigned long limit)
+{
+    dev_addr addr;
+    unsigned char hdrtype;
+    unsigned long base, size, upper;
+    unsigned slot, fn, maxfn, i, j, nbars;
+    int status = 0;
+    used_count = 0;
+    for (i = 0; i < 6 && status >= 0; i++)
+    {
+        if ((own->value[i] & 1) || own->probe[i] == 0)
+            continue;
+        base = own->value[i] & ~0xFUL;
+        size = (~(own->probe[i] & ~0xFUL) + 1) & 0xFFFFFFFFUL;
+        if ((own->value[i] & 6) == 4 && (++i == 6 || own->value[i] != 0))
+            continue;
+        if (base != 0)
+            status = add_used(base, size, 1);
+    }
+    if (status < 0)
+        return -1;
+    for (slot = 0; slot < 32; slot++)
+    {
+        maxfn = 1;
+        for (fn = 0; fn < maxfn; fn++)
+        {
+            addr = ADDR(dev >> 8, slot, fn);
+            if (pci_read_byte(addr, 0xE, &hdrtype) < 0 || hdrtype == 0xFF)
+                continue;       // functions need not be numbered contiguously
+            if (fn == 0 && (hdrtype & 0x80))
+                maxfn = 8;
+            switch (hdrtype & 0x7F)
+            {
+                case 0:
+                    nbars = 6;
+                    break;
+                case 1:
+                    nbars = 2;
+                    break;
+                case 2:
+                    nbars = 1;
+                    break;
+                default:
+                    continue;
+            }
+            for (i = 0; i < nbars && addr != dev && status >= 0; i++)
+            {
+                if (pci_read_dword(addr, 0x10 + 4 * i, &base) < 0)
+                    return -1;
+                if (base & 1)
+                    continue;
+                upper = 0;
+                if ((base & 6) == 4 && (++i == nbars || pci_read_dword(addr, 0x10 + 4 * i, &upper) < 0))
+                    continue;
+                if (upper == 0)
+                    status = add_unsized(base & ~0xFUL);
+            }
+            if (status >= 0 && addr != dev && nbars != 1)
+            {
+                if (pci_read_dword(addr, nbars == 6 ? 0x30 : 0x38, &base) < 0)
+                    return -1;
+                status = add_unsized(base & 0xFFFFF800UL);
+            }
+            for (i = 0x20; nbars == 2 && i <= 0x24 && status >= 0; i += 4)
+            {
+                status = bridge_window(addr, i, &base, &size);
+                if (status > 0)
+                    status = add_used(base, size, 1);
+            }
+            if (status < 0)
+                return -1;
+        }
+    }
+    for (i = 0; i < used_count; i++)
+    {
+        if (used[i].exact)
+            continue;
+        if (used[i].start <= limit && used[i].end > limit)
+            used[i].end = limit;
+        for (j = 0; j < used_count; j++)
+        {
+            if (used[j].start > used[i].start && used[j].start <= used[i].end)
+                used[i].end = used[j].start - 1;
+        }
+    }
+    return 0;
+}
+
+// Searches the memory window of the bridge leading to the bus of dev for a
+// naturally aligned range of the given size nothing on that bus decodes.
+static int free_window(dev_addr dev, const bar_record_t* bars, unsigned long size, unsigned long* address)
+{
+    unsigned bus = dev >> 8;
+    unsigned pbus, pdev, pfn, i;
+    unsigned char hdrtype, secondary;
+    unsigned long base, window, candidate;
+    int found = 0;
+    if (bus == 0)
+        return 0;       // the host bridge window is not described in config space
+    for (pbus = 0; pbus <= last_bus && !found; pbus++)
+    {
+        for (pdev = 0; pdev < 32 && !found; pdev++)
+        {
+            for (pfn = 0; pfn < 8 && !found; pfn++)
+            {
+                if (pci_read_byte(ADDR(pbus, pdev, pfn), 0xE, &hdrtype) < 0 || hdrtype == 0xFF)
+                {
+                    if (pfn == 0)
+                        break;
+                    continue;
+                }
+                if ((hdrtype & 0x7F) == 1 &&
+                    pci_read_byte(ADDR(pbus, pdev, pfn), 0x19, &secondary) >= 0 && secondary == bus)
+                {
+                    found = 1;
+                    if (bridge_window(ADDR(pbus, pdev, pfn), 0x20, &base, &window) <= 0)
+                        return 0;
+                }
+                if (pfn == 0 && !(hdrtype & 0x80))
+                    break;
+            }
+        }
+    }
+    if (!found || window < size || collect_used(dev, bars, base + window - 1) < 0)
+        return 0;
+    candidate = (base + size - 1) & ~(size - 1);
+    while (candidate != 0 && candidate - base <= window - size)
+    {
+        for (i = 0; i < used_count; i++)
+        {
+            if (used[i].start <= candidate + size - 1 && used[i].end >= candidate)
+                break;
+        }
+        if (i == used_count)
+        {
+            *address = candidate;
+            return 1;
+        }
+        candidate = (used[i].end + size) & ~(size - 1);
+    }
+    return 0;
+}
+
+int pci_rom_window(dev_addr dev, int share_bar, unsigned* reg, unsigned long* address, unsigned long* size)
+{
+    bar_record_t bars;
+    unsigned vendor;
+    unsigned char hdrtype;
+    unsigned long barsize;
+    unsigned i;
+    if (pci_read_word(dev, 0, &vendor) < 0 || vendor == 0xFFFF)
+    {
+        fputs("specified PCI device does not exist\n", stderr);
+        return -1;
+    }
+    if (pci_read_byte(dev, 0xE, &hdrtype) < 0 || pci_probe_bars(dev, &bars) < 0)
+    {
+        fputs("sizing the base address registers failed\n", stderr);
+        return -1;
+    }
+    *reg = (hdrtype & 0x7F) == 1 ? 0x38 : 0x30;
+    *size = (~(bars.probe[PROBE_ROM] & 0xFFFFF800UL) + 1) & 0xFFFFFFFFUL;
+    if (bars.probe[PROBE_ROM] == 0 || *size == 0)
+    {
+        fputs("specified PCI device has no expansion ROM\n", stderr);
+        return -1;
+    }
+    *address = bars.value[PROBE_ROM] & 0xFFFFF800UL;
+    if (*address != 0 || free_window(dev, &bars, *size, address))
+        return 0;
+    if (!share_bar)
+    {
+        fputs("no free address to map the expansion ROM at\n", stderr);
+        return -1;
+    }
+    // The ROM may share the address decoder of another memory BAR, as long
+    // as that BAR is not accessed while the ROM is enabled. Any memory BAR
+    // that is at least as large is suitably aligned.
+    for (i = 0; i < 6; i++)
+    {
+        if ((bars.value[i] & 1) || (bars.value[i] & ~0xFUL) == 0)
+            continue;
+        if ((bars.value[i] & 6) == 4 && (i == 5 || bars.value[i + 1] != 0))
+            continue;
+        barsize = (~(bars.probe[i] & ~0xFUL) + 1) & 0xFFFFFFFFUL;
+        if (barsize >= *size)
+        {
+            *address = bars.value[i] & ~0xFUL;
+            return 0;
+        }
+    }
+    fputs("no address to map the expansion ROM at\n", stderr);
+    return -1;
+}
+
+int pci_probe_bars(dev_addr dev, bar_record_t *bars)
+{
+    unsigned char hdrtype;
+    unsigned int oldcmd;
+    unsigned int nbars, rombar;
+    unsigned int i;
+    int status;
+
+    for (i = 0; i < PROBE_COUNT; i++)
+    {
+        bars->value[i] = 0;
+        bars->probe[i] = 0;
+    }
+    if (pci_read_byte(dev, 0xE, &hdrtype) < 0)
+        return -1;
+    switch (hdrtype & 0x7F)
+    {
+        case 0:
+            nbars = 6;
+            rombar = 0x30;
+            break;
+        case 1:
+            nbars = 2;
+            rombar = 0x38;
+            break;
+        case 2:
+            // CardBus bridges have just the socket registers
+            nbars = 1;
+            rombar = 0;
+            break;
+        default:
+            return -1;
+    }
+    if (pci_read_word(dev, 4, &oldcmd) < 0)
+        return -1;
+    status = 0;
+    if (oldcmd & (CMD_IO | CMD_MEM))
+        status = pci_write_word(dev, 4, oldcmd & ~(CMD_IO | CMD_MEM));
+    for (i = 0; i < nbars && status >= 0; i++)
+    {
+        status = pci_read_dword(dev, 0x10 + 4*i, &bars->value[i]);
+        status |= pci_write_dword(dev, 0x10 + 4*i, 0xFFFFFFFFUL);
+        status |= pci_read_dword(dev, 0x10 + 4*i, &bars->probe[i]);
+        status |= pci_write_dword(dev, 0x10 + 4*i, bars->value[i]);
+    }
+    if (rombar != 0 && status >= 0)
+    {
+        status = pci_read_dword(dev, rombar, &bars->value[PROBE_ROM]);
+        status |= pci_write_dword(dev, rombar, 0xFFFFFFFFUL);
+        status |= pci_read_dword(dev, rombar, &bars->probe[PROBE_ROM]);
+        status |= pci_write_dword(dev, rombar, bars->value[PROBE_ROM]);
+    }
+    if (oldcmd & (CMD_IO | CMD_MEM))
+        status |= pci_write_word(dev, 4, oldcmd);
+    return status;
+}
@@ -1,9 +1,6 @@
 #include <dos.h>
 #include "pci.h"
 
-unsigned char last_bus = 0;
-unsigned int bios_version;
-
 int pci_init(void)
 {
     union REGS r;
@@ -15,6 +12,17 @@ int pci_init(void)
     {
         last_bus = r.h.cl;
         bios_version = r.x.bx;
+        // AL bit 0 announces mechanism #1, but don't trust it blindly
+        if (pci_access == PCI_ACCESS_AUTO)
+        {
+            if ((r.h.al & 1) && pci_cf8_probe() >= 0)
+                pci_access = PCI_ACCESS_CF8;
+            else
+                pci_access = PCI_ACCESS_BIOS;
+        }
+        else if (pci_access == PCI_ACCESS_CF8 && pci_cf8_probe() < 0)
+            return -2;
+        pci_backend = pci_access == PCI_ACCESS_CF8 ? &pci_cf8_backend : &pci_bios_backend;
         return 0;
     }
     return -1;
@@ -0,0 +1,265 @@
+// Configuration space images: pci_image_create/add/close capture functions
+// from the live backend, pci_image_load replays them as a backend.
+//
+// File format, all numbers little endian:
+//   header:  "PCIIMAGE", version (1 byte), last_bus (1 byte), BIOS version (2 bytes)
+//   records: address (2 bytes), configuration space (256 bytes),
+//            BAR 0..5 and ROM BAR probe results (7 * 4 bytes)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pci.h"
+
+#define IMAGE_MAGIC "PCIIMAGE"
+#define IMAGE_VERSION 1
+#define HEADER_SIZE 12
+#define RECORD_SIZE (2 + 256 + 4 * PROBE_COUNT)
+
+struct image_function {
+    struct image_function *next;
+    dev_addr addr;
+    unsigned long probe[PROBE_COUNT];
+    unsigned char config[256];
+};
+
+static struct image_function *functions;
+static struct image_function *last_hit;
+static FILE *image_file;
+
+static void put_dword(unsigned char *p, unsigned long value)
+{
+    p[0] = (unsigned char)value;
+    p[1] = (unsigned char)(value >> 8);
+    p[2] = (unsigned char)(value >> 16);
+    p[3] = (unsigned char)(value >> 24);
+}
+
+static unsigned long get_dword(const unsigned char *p)
+{
+    return p[0] | ((unsigned)p[1] << 8) |
+           ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+int pci_image_create(const char *filename)
+{
+    unsigned char header[HEADER_SIZE];
+    image_file = fopen(filename, "wb");
+    if (!image_file)
+        return -1;
+    memcpy(header, IMAGE_MAGIC, 8);
+    header[8] = IMAGE_VERSION;
+    header[9] = last_bus;
+    header[10] = (unsigned char)bios_version;
+    header[11] = (unsigned char)(bios_version >> 8);
+    if (fwrite(header, 1, HEADER_SIZE, image_file) != HEADER_SIZE)
+    {
+        fclose(image_file);
+        image_file = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int pci_image_add(dev_addr dev)
+{
+    unsigned char record[RECORD_SIZE];
+    bar_record_t bars;
+    unsigned long value;
+    unsigned int reg;
+    int status = 0;
+
+    record[0] = (unsigned char)dev;
+    record[1] = (unsigned char)(dev >> 8);
+    pci_cache_open(dev, 0x100);
+    for (reg = 0; reg < 0x100; reg += 4)
+    {
+        // Extended registers might not be readable (e.g. on Linux as non-root)
+        if (pci_read_dword(dev, reg, &value) < 0)
+        {
+            if (reg < 0x40)
+                status = -1;
+            value = 0xFFFFFFFFUL;
+        }
+        put_dword(record + 2 + reg, value);
+    }
+    pci_cache_close();
+    if (pci_probe_bars(dev, &bars) < 0)
+        status = -1;
+    for (reg = 0; reg < PROBE_COUNT; reg++)
+        put_dword(record + 2 + 256 + 4 * reg, bars.probe[reg]);
+    if (fwrite(record, 1, RECORD_SIZE, image_file) != RECORD_SIZE)
+        status = -1;
+    return status;
+}
+
+int pci_image_close(void)
+{
+    return fclose(image_file);
+}
+
+static struct image_function *find_function(dev_addr dev)
+{
+    struct image_function *f;
+    if (last_hit && last_hit->addr == dev)
+        return last_hit;
+    for (f = functions; f; f = f->next)
+    {
+        if (f->addr == dev)
+        {
+            last_hit = f;
+            return f;
+        }
+    }
+    return NULL;
+}
+
+static int image_read_block(dev_addr dev, unsigned int reg, unsigned char* buf, unsigned int len)
+{
+    struct image_function *f = find_function(dev);
+    if (reg + len > 0x100)
+        return -1;
+    if (f)
+        memcpy(buf, f->config + reg, len);
+    else
+        memset(buf, 0xFF, len);   // absent functions read as all ones
+    return 0;
+}
+
+static int image_read_byte(dev_addr dev, unsigned int reg, unsigned char* data)
+{
+    return image_read_block(dev, reg, data, 1);
+}
+
+static int image_read_word(dev_addr dev, unsigned int reg, unsigned* data)
+{
+    unsigned char buf[2];
+    if (image_read_block(dev, reg, buf, 2) < 0)
+        return -1;
+    *data = buf[0] | (buf[1] << 8);
+    return 0;
+}
+
+static int image_read_dword(dev_addr dev, unsigned int reg, unsigned long* data)
+{
+    unsigned char buf[4];
+    if (image_read_block(dev, reg, buf, 4) < 0)
+        return -1;
+    *data = get_dword(buf);
+    return 0;
+}
+
+// Returns the bits of a BAR that take the written value. Everything else,
+// i.e. type flags and address bits below the BAR size, keeps its value. This
+// makes the usual write-ones-and-read-back sizing work on the image.
+// Returns -1 if the BAR is in use, but sizing it failed during capture.
+static int writable_bits(struct image_function *f, unsigned int reg, unsigned long *bits)
+{
+    unsigned char hdrtype = f->config[0xE] & 0x7F;
+    unsigned long probe;
+    unsigned int bar;
+    *bits = 0xFFFFFFFFUL;
+    if ((hdrtype == 0 && reg == 0x30) || (hdrtype == 1 && reg == 0x38))
+    {
+        probe = f->probe[PROBE_ROM];
+        *bits = probe & 0xFFFFF801UL;
+    }
+    else if (reg >= 0x10 && reg < (hdrtype == 0 ? 0x28u : hdrtype == 1 ? 0x18u : 0x14u))
+    {
+        bar = (reg - 0x10) / 4;
+        probe = f->probe[bar];
+        if (bar > 0 && (f->config[reg - 4] & 7) == 4)
+            *bits = probe;                  // upper half of a 64-bit BAR
+        else if (f->config[reg] & 1)
+            *bits = probe & ~3UL;
+        else
+            *bits = probe & ~0xFUL;
+    }
+    else
+        return 0;
+    return (probe == 0 && get_dword(f->config + reg) != 0) ? -1 : 0;
+}
+
+static int image_write(dev_addr dev, unsigned int reg, unsigned long data, unsigned int size)
+{
+    struct image_function *f = find_function(dev);
+    unsigned char *p;
+    unsigned long old, mask, writable;
+    if (!f || reg + size > 0x100)
+        return -1;
+    p = f->config + (reg & 0xFC);
+    old = get_dword(p);
+    mask = size == 4 ? 0xFFFFFFFFUL : ((1UL << (8 * size)) - 1) << (8 * (reg & 3));
+    data <<= 8 * (reg & 3);
+    if (writable_bits(f, reg & 0xFC, &writable) < 0)
+        return -1;
+    writable &= mask;
+    put_dword(p, (old & ~writable) | (data & writable));
+    return 0;
+}
+
+static int image_write_byte(dev_addr dev, unsigned int reg, unsigned char data)
+{
+    return image_write(dev, reg, data, 1);
+}
+
+static int image_write_word(dev_addr dev, unsigned int reg, unsigned data)
+{
+    return image_write(dev, reg, data, 2);
+}
+
+static int image_write_dword(dev_addr dev, unsigned int reg, unsigned long data)
+{
+    return image_write(dev, reg, data, 4);
+}
+
+const pci_backend_t pci_image_backend = {
+    "configuration space image",
+    image_read_byte, image_read_word, image_read_dword,
+    image_write_byte, image_write_word, image_write_dword,
+    image_read_block
+};
+
+int pci_image_load(const char *filename)
+{
+    unsigned char header[HEADER_SIZE];
+    unsigned char addr[2];
+    struct image_function *f;
+    struct image_function **tail = &functions;
+    unsigned int i;
+    int status = 0;
+    FILE *in = fopen(filename, "rb");
+    if (!in)
+        return -1;
+    if (fread(header, 1, HEADER_SIZE, in) != HEADER_SIZE ||
+        memcmp(header, IMAGE_MAGIC, 8) != 0 ||
+        header[8] != IMAGE_VERSION)
+    {
+        fclose(in);
+        return -1;
+    }
+    last_bus = header[9];
+    bios_version = header[10] | (header[11] << 8);
+    while (status == 0 && fread(addr, 1, 2, in) == 2)
+    {
+        unsigned char probe[4 * PROBE_COUNT];
+        f = malloc(sizeof *f);
+        if (!f ||
+            fread(f->config, 1, 256, in) != 256 ||
+            fread(probe, 1, sizeof probe, in) != sizeof probe)
+        {
+            free(f);
+            status = -1;
+            break;
+        }
+        f->addr = addr[0] | (addr[1] << 8);
+        for (i = 0; i < PROBE_COUNT; i++)
+            f->probe[i] = get_dword(probe + 4 * i);
+        f->next = NULL;
+        *tail = f;
+        tail = &f->next;
+    }
+    fclose(in);
+    if (status == 0)
+        pci_backend = &pci_image_backend;
+    return status;
+}
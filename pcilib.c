@@ -1,4 +1,6 @@
+#include <conio.h>
 #include <dos.h>
+#include <stddef.h>
 #include "pci.h"
 
 #ifdef __WATCOMC__
@@ -21,38 +23,32 @@
 
 #endif
 
-int dev_by_id(unsigned int vendor, unsigned int device, int index, dev_addr *addr)
+void my_outpd(unsigned port, unsigned long value)
 {
-    union REGS r;
-    r.x.ax = 0xB102;
-    r.x.dx = vendor;
-    r.x.cx = device;
-    r.x.si = index;
-    int86(0x1A, &r, &r);
-    if (r.x.cflag)
-       return -1;
-    *addr = r.x.bx;
-    return 0;
+    asm {
+        mov dx, [port]
+        db 66h
+        mov ax, [WORD PTR value]
+        db 66h
+        out dx,ax
+    }
 }
 
-int dev_by_class(unsigned long classcode, int index, dev_addr *dev)
+unsigned long my_inpd(unsigned port)
 {
-    RETURNING_AX_PREFIX
     asm {
-        mov ax,0B103h
+        mov dx, [port]
         db 66h
-        mov cx,[WORD PTR classcode]
-        mov si,[index]
-        int 1Ah
-        sbb ax,ax
-        mov si, dev
-        mov [si],bx
-        RETURNING_AX_ASM_SUFFIX
+        in ax,dx
+        db 66h
+        mov dx,ax
+        mov cl,10h
+        db 66h
+        shr dx,cl
     }
-    RETURNING_AX_C_SUFFIX
 }
 
-int pci_read_byte(dev_addr dev, unsigned int reg, unsigned char* data)
+static int bios_read_byte(dev_addr dev, unsigned int reg, unsigned char* data)
 {
     union REGS r;
     r.x.ax = 0xB108;
@@ -65,7 +61,7 @@ int pci_read_byte(dev_addr dev, unsigned int reg, unsigned char* data)
     return 0;
 }
 
-int pci_read_word(dev_addr dev, unsigned int reg, unsigned* data)
+static int bios_read_word(dev_addr dev, unsigned int reg, unsigned* data)
 {
     union REGS r;
     r.x.ax = 0xB109;
@@ -78,7 +74,7 @@ int pci_read_word(dev_addr dev, unsigned int reg, unsigned* data)
     return 0;
 }
 
-int pci_read_dword(dev_addr dev, unsigned int reg, unsigned long* data)
+static int bios_read_dword(dev_addr dev, unsigned int reg, unsigned long* data)
 {
     RETURNING_AX_PREFIX
     asm {
@@ -95,7 +91,7 @@ int pci_read_dword(dev_addr dev, unsigned int reg, unsigned long* data)
     RETURNING_AX_C_SUFFIX
 }
 
-int pci_write_byte(dev_addr dev, unsigned int reg, unsigned char data)
+static int bios_write_byte(dev_addr dev, unsigned int reg, unsigned char data)
 {
     union REGS r;
     r.x.ax = 0xB10B;
@@ -108,7 +104,7 @@ int pci_write_byte(dev_addr dev, unsigned int reg, unsigned char data)
     return 0;
 }
 
-int pci_write_word(dev_addr dev, unsigned int reg, unsigned data)
+static int bios_write_word(dev_addr dev, unsigned int reg, unsigned data)
 {
     union REGS r;
     r.x.ax = 0xB10c;
@@ -121,7 +117,7 @@ int pci_write_word(dev_addr dev, unsigned int reg, unsigned data)
     return 0;
 }
 
-int pci_write_dword(dev_addr dev, unsigned int reg, unsigned long data)
+static int bios_write_dword(dev_addr dev, unsigned int reg, unsigned long data)
 {
     RETURNING_AX_PREFIX
     asm {
@@ -136,3 +132,103 @@ int pci_write_dword(dev_addr dev, unsigned int reg, unsigned long data)
     }
     RETURNING_AX_C_SUFFIX
 }
+
+const pci_backend_t pci_bios_backend = {
+    "PCI BIOS",
+    bios_read_byte, bios_read_word, bios_read_dword,
+    bios_write_byte, bios_write_word, bios_write_dword,
+    NULL
+};
+
+// Configuration mechanism #1: address register at CF8, data window at CFC..CFF.
+// Interrupts are disabled while CF8 is pointing to our register, so a
+// resident driver accessing config space can't interfere.
+#define CF8_ADDR(dev, reg) (0x80000000UL | ((unsigned long)(dev) << 8) | ((reg) & 0xFC))
+
+static int cf8_read_byte(dev_addr dev, unsigned int reg, unsigned char* data)
+{
+    _disable();
+    my_outpd(0xCF8, CF8_ADDR(dev, reg));
+    *data = inp(0xCFC + (reg & 3));
+    _enable();
+    return 0;
+}
+
+static int cf8_read_word(dev_addr dev, unsigned int reg, unsigned* data)
+{
+    _disable();
+    my_outpd(0xCF8, CF8_ADDR(dev, reg));
+    *data = inpw(0xCFC + (reg & 2));
+    _enable();
+    return 0;
+}
+
+static int cf8_read_dword(dev_addr dev, unsigned int reg, unsigned long* data)
+{
+    _disable();
+    my_outpd(0xCF8, CF8_ADDR(dev, reg));
+    *data = my_inpd(0xCFC);
+    _enable();
+    return 0;
+}
+
+static int cf8_write_byte(dev_addr dev, unsigned int reg, unsigned char data)
+{
+    _disable();
+    my_outpd(0xCF8, CF8_ADDR(dev, reg));
+    outp(0xCFC + (reg & 3), data);
+    _enable();
+    return 0;
+}
+
+static int cf8_write_word(dev_addr dev, unsigned int reg, unsigned data)
+{
+    _disable();
+    my_outpd(0xCF8, CF8_ADDR(dev, reg));
+    outpw(0xCFC + (reg & 2), data);
+    _enable();
+    return 0;
+}
+
+static int cf8_write_dword(dev_addr dev, unsigned int reg, unsigned long data)
+{
+    _disable();
+    my_outpd(0xCF8, CF8_ADDR(dev, reg));
+    my_outpd(0xCFC, data);
+    _enable();
+    return 0;
+}
+
+const pci_backend_t pci_cf8_backend = {
+    "mechanism #1",
+    cf8_read_byte, cf8_read_word, cf8_read_dword,
+    cf8_write_byte, cf8_write_word, cf8_write_dword,
+    NULL
+};
+
+int pci_cf8_probe(void)
+{
+    unsigned long oldaddr;
+    unsigned long bios_id, cf8_id;
+    int status = -1;
+
+    // Same check as Linux: a mechanism #2 chipset only decodes CF8 as a
+    // byte register, so writing CFB first and then reading back a full
+    // dword from CF8 identifies a mechanism #1 address register
+    _disable();
+    outp(0xCFB, 0x01);
+    oldaddr = my_inpd(0xCF8);
+    my_outpd(0xCF8, 0x80000000UL);
+    if (my_inpd(0xCF8) == 0x80000000UL)
+        status = 0;
+    my_outpd(0xCF8, oldaddr);
+    _enable();
+
+    // the host bridge has to look the same both ways
+    if (status == 0 &&
+        (bios_read_dword(ADDR(0, 0, 0), 0, &bios_id) < 0 ||
+         cf8_read_dword(ADDR(0, 0, 0), 0, &cf8_id) < 0 ||
+         bios_id != cf8_id))
+        status = -1;
+    return status;
+}
@@ -0,0 +1,160 @@
+// Linux backend: configuration space through /sys/bus/pci/devices/*/config.
+// This replaces pcibase.c and pcilib.c when building natively on Linux.
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "pci.h"
+
+#define SYSFS_DEVICES "/sys/bus/pci/devices"
+
+// The config file of the most recently accessed function stays open, as the
+// dump and patch code works on one function at a time.
+static int cfg_fd = -1;
+static int cfg_missing;
+static dev_addr cfg_dev;
+
+static int sysfs_open(dev_addr dev)
+{
+    char path[64];
+    if (cfg_fd >= 0 || cfg_missing)
+    {
+        if (cfg_dev == dev)
+            return 0;
+        if (cfg_fd >= 0)
+            close(cfg_fd);
+    }
+    cfg_fd = -1;
+    cfg_missing = 0;
+    cfg_dev = dev;
+    sprintf(path, SYSFS_DEVICES "/0000:%02x:%02x.%d/config",
+            dev >> 8, (dev >> 3) & 0x1F, dev & 7);
+    cfg_fd = open(path, O_RDWR);
+    if (cfg_fd < 0 && (errno == EACCES || errno == EPERM))
+        cfg_fd = open(path, O_RDONLY);
+    if (cfg_fd < 0)
+    {
+        if (errno != ENOENT)
+            return -1;
+        // reads from absent functions return all ones, like on real hardware
+        cfg_missing = 1;
+    }
+    return 0;
+}
+
+static int sysfs_read_block(dev_addr dev, unsigned int reg, unsigned char* buf, unsigned int len)
+{
+    if (sysfs_open(dev) < 0)
+        return -1;
+    if (cfg_missing)
+    {
+        memset(buf, 0xFF, len);
+        return 0;
+    }
+    // without root, only the header is readable and the read comes up short
+    if (pread(cfg_fd, buf, len, reg) != (ssize_t)len)
+        return -1;
+    return 0;
+}
+
+static int sysfs_write_block(dev_addr dev, unsigned int reg, const unsigned char* buf, unsigned int len)
+{
+    if (sysfs_open(dev) < 0 || cfg_missing)
+        return -1;
+    if (pwrite(cfg_fd, buf, len, reg) != (ssize_t)len)
+        return -1;
+    return 0;
+}
+
+static int sysfs_read_byte(dev_addr dev, unsigned int reg, unsigned char* data)
+{
+    return sysfs_read_block(dev, reg, data, 1);
+}
+
+static int sysfs_read_word(dev_addr dev, unsigned int reg, unsigned* data)
+{
+    unsigned char buf[2];
+    if (sysfs_read_block(dev, reg, buf, 2) < 0)
+        return -1;
+    *data = buf[0] | (buf[1] << 8);
+    return 0;
+}
+
+static int sysfs_read_dword(dev_addr dev, unsigned int reg, unsigned long* data)
+{
+    unsigned char buf[4];
+    if (sysfs_read_block(dev, reg, buf, 4) < 0)
+        return -1;
+    *data = buf[0] | (buf[1] << 8) | ((unsigned long)buf[2] << 16) | ((unsigned long)buf[3] << 24);
+    return 0;
+}
+
+static int sysfs_write_byte(dev_addr dev, unsigned int reg, unsigned char data)
+{
+    return sysfs_write_block(dev, reg, &data, 1);
+}
+
+static int sysfs_write_word(dev_addr dev, unsigned int reg, unsigned data)
+{
+    unsigned char buf[2];
+    buf[0] = data;
+    buf[1] = data >> 8;
+    return sysfs_write_block(dev, reg, buf, 2);
+}
+
+static int sysfs_write_dword(dev_addr dev, unsigned int reg, unsigned long data)
+{
+    unsigned char buf[4];
+    buf[0] = data;
+    buf[1] = data >> 8;
+    buf[2] = data >> 16;
+    buf[3] = data >> 24;
+    return sysfs_write_block(dev, reg, buf, 4);
+}
+
+const pci_backend_t pci_sysfs_backend = {
+    "Linux sysfs",
+    sysfs_read_byte, sysfs_read_word, sysfs_read_dword,
+    sysfs_write_byte, sysfs_write_word, sysfs_write_dword,
+    sysfs_read_block
+};
+
+// Only PCI domain 0 is supported, as dev_addr has no room for domains.
+static int domain0_only(const struct dirent *entry)
+{
+    return strncmp(entry->d_name, "0000:", 5) == 0 && strlen(entry->d_name) == 12;
+}
+
+static dev_addr name_to_addr(const char *name)
+{
+    unsigned bus, dev, fn;
+    if (sscanf(name, "0000:%x:%x.%x", &bus, &dev, &fn) != 3)
+        return 0xFFFF;
+    return ADDR(bus, dev, fn);
+}
+
+int pci_init(void)
+{
+    struct dirent **list;
+    int count, i;
+    if (pci_access != PCI_ACCESS_AUTO)
+        return -3;
+    count = scandir(SYSFS_DEVICES, &list, domain0_only, alphasort);
+    if (count < 0)
+        return -1;
+    last_bus = 0;
+    for (i = 0; i < count; i++)
+    {
+        dev_addr addr = name_to_addr(list[i]->d_name);
+        if (addr != 0xFFFF && (addr >> 8) > last_bus)
+            last_bus = addr >> 8;
+        free(list[i]);
+    }
+    free(list);
+    bios_version = 0;
+    pci_backend = &pci_sysfs_backend;
+    return 0;
+}